@@ -1,4 +1,4 @@
-// cc -o vmacho vmacho.c -Wall -O3
+// cc -o vmacho vmacho.c -Wall -O3 -pthread
 // cl vmacho.c /O2 /W3
 #define _CRT_SECURE_NO_WARNINGS
 #include <errno.h>
@@ -7,9 +7,27 @@
 #include <stdio.h>              // fopen, fclose, ftell, fseek, fflush, fprintf, stdin, stdout, stderr
 #include <stdlib.h>             // malloc, free
 #include <string.h>             // memset, strcmp, strerror
+#ifndef _WIN32
+#   include <unistd.h>          // ftruncate, pwrite, sysconf
+#   include <sys/mman.h>        // mmap, munmap, madvise, MAP_FAILED
+#   include <sys/stat.h>        // fstat, S_ISREG
+#   include <dirent.h>          // opendir, readdir, closedir
+#   include <pthread.h>
+#endif
 
-#define LOG(str, ...) do { fprintf(stderr, str "\n", ##__VA_ARGS__); } while(0)
+// Messages say which input and slice they're about, since slices and batch jobs run in parallel.
+#define LOG(str, ...) do { fprintf(stderr, "%s%s" str "\n", log_what ? log_what : "", log_what ? ": " : "", ##__VA_ARGS__); } while(0)
 
+// What the current thread is working on, e.g. "in" or "in (arm64)", if anything.
+// Windows builds run everything on one thread, and MSVC only knows _Thread_local from /std:c11 on.
+#ifdef _WIN32
+static const char *log_what;
+#else
+static _Thread_local const char *log_what;
+#endif
+
+#define FAT_MAGIC           0xcafebabe
+#define FAT_MAGIC_64        0xcafebabf
 #define MH_MAGIC            0xfeedface
 #define MH_MAGIC_64         0xfeedfacf
 #define LC_SEGMENT          0x1
@@ -17,8 +35,55 @@
 #define SEC_TYPE_MASK       0x000000ff
 #define SEC_TYPE_ZEROFILL   0x1
 
+#define CPU_TYPE_X86        7
+#define CPU_TYPE_ARM        12
+#define CPU_TYPE_POWERPC    18
+#define CPU_ARCH_ABI64      0x01000000
+#define CPU_ARCH_ABI64_32   0x02000000
+#define CPU_SUBTYPE_MASK    0xff000000
+#define CPU_SUBTYPE_ANY     0xffffffff
+
+#define EM_386              3
+#define EM_ARM              40
+#define EM_X86_64           62
+#define EM_AARCH64          183
+#define EM_RISCV            243
+#define EF_ARM_EABI_VER5    0x05000000
+#define EF_RISCV_FLOAT_ABI_DOUBLE 0x4
+#define SHT_PROGBITS        1
+#define SHT_SYMTAB          2
+#define SHT_STRTAB          3
+#define SHF_ALLOC           0x2
+#define STB_GLOBAL_OBJECT   0x11
+
 typedef uint32_t vm_prot_t;
 
+// Fat headers are big endian.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t nfat_arch;
+} fat_hdr_t;
+
+typedef struct
+{
+    uint32_t cputype;
+    uint32_t cpusubtype;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t align;
+} fat_arch32_t;
+
+typedef struct
+{
+    uint32_t cputype;
+    uint32_t cpusubtype;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t align;
+    uint32_t reserved;
+} fat_arch64_t;
+
 typedef struct
 {
     uint32_t magic;
@@ -106,13 +171,214 @@ typedef struct
     uint32_t reserved[3];
 } mach_sect64_t;
 
+typedef struct
+{
+    uint8_t  ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint64_t entry;
+    uint64_t phoff;
+    uint64_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} elf64_hdr_t;
+
+typedef struct
+{
+    uint32_t name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t addr;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+    uint32_t info;
+    uint64_t addralign;
+    uint64_t entsize;
+} elf64_shdr_t;
+
+typedef struct
+{
+    uint32_t name;
+    uint8_t  info;
+    uint8_t  other;
+    uint16_t shndx;
+    uint64_t value;
+    uint64_t size;
+} elf64_sym_t;
+
+typedef struct
+{
+    uint8_t  ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint32_t entry;
+    uint32_t phoff;
+    uint32_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} elf32_hdr_t;
+
+typedef struct
+{
+    uint32_t name;
+    uint32_t type;
+    uint32_t flags;
+    uint32_t addr;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t link;
+    uint32_t info;
+    uint32_t addralign;
+    uint32_t entsize;
+} elf32_shdr_t;
+
+typedef struct
+{
+    uint32_t name;
+    uint32_t value;
+    uint32_t size;
+    uint8_t  info;
+    uint8_t  other;
+    uint16_t shndx;
+} elf32_sym_t;
+
+// What an ELF object is for.
+typedef struct
+{
+    uint16_t machine;
+    bool is64;
+    uint32_t flags;
+} elf_target_t;
+
 typedef enum
 {
     Mode_Binary,
     Mode_HeadlessArray,
     Mode_NamedArray,
+    Mode_Elf,
+    Mode_Incbin,
 } vmacho_mode_t;
 
+typedef struct
+{
+    vmacho_mode_t mode;
+    const char *oflags;
+    const char *aname;
+    elf_target_t elf;
+    bool use_sections;
+    size_t fmax;
+    size_t smax;
+    const char *arch;
+    bool all;
+} vmacho_opts_t;
+
+typedef struct
+{
+    uint32_t cputype;
+    uint32_t cpusubtype;
+    uint64_t offset;
+    uint64_t size;
+    const void *file; // Only for mapped input
+    char name[32];
+    char *what;       // For LOG(), the input and this slice's name
+    // Only for -A
+    const vmacho_opts_t *opt;
+    char *out;
+    bool ok;
+#ifndef _WIN32
+    pthread_t thread;
+    bool joinable;
+#endif
+} slice_t;
+
+typedef struct
+{
+    FILE *f;
+    uint64_t pos;
+} stream_t;
+
+// Length of a thin Mach-O coming in on a stream, which only shows once the stream ends.
+#define LEN_UNKNOWN SIZE_MAX
+
+typedef struct
+{
+    uint64_t fileoff;
+    uint64_t size;
+    uint64_t dst; // Offset in the image
+    uint64_t cmd; // Offset of its load command, for messages
+    // For output written front to back:
+    uint64_t got;   // How much of it has come in
+    uint8_t *held;  // What came in before its turn
+    bool live;      // Its turn has come, so it's written as it comes in
+} range_t;
+
+// Output that can only be written front to back, i.e. anything but a regular file, and C arrays.
+// The ranges are written in image order, with zeroes in between.
+typedef struct
+{
+    FILE *f;
+    uint64_t pos;       // How much of the image is out
+    range_t **order;    // The ranges by offset in the image
+    size_t n;
+    size_t next;        // The first of them not all out yet
+    char *txt;          // C array output is formatted in here, raw if NULL
+    uint8_t row[0x10];  // The start of a row that isn't complete yet
+    size_t nrow;
+} seq_t;
+
+typedef struct
+{
+    char *in;
+    char *out;
+    bool ok;
+} job_t;
+
+typedef struct
+{
+    const vmacho_opts_t *opt;
+    job_t *job;
+    size_t num;
+    size_t next;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+} batch_t;
+
+static const struct
+{
+    const char *name;
+    uint32_t cputype;
+    uint32_t cpusubtype;
+} arch_names[] =
+{
+    { "i386",     CPU_TYPE_X86,                          3 },
+    { "x86_64",   CPU_TYPE_X86      | CPU_ARCH_ABI64,    3 },
+    { "x86_64h",  CPU_TYPE_X86      | CPU_ARCH_ABI64,    8 },
+    { "armv6",    CPU_TYPE_ARM,                          6 },
+    { "armv7",    CPU_TYPE_ARM,                          9 },
+    { "armv7s",   CPU_TYPE_ARM,                         11 },
+    { "armv7k",   CPU_TYPE_ARM,                         12 },
+    { "arm64",    CPU_TYPE_ARM      | CPU_ARCH_ABI64,    0 },
+    { "arm64v8",  CPU_TYPE_ARM      | CPU_ARCH_ABI64,    1 },
+    { "arm64e",   CPU_TYPE_ARM      | CPU_ARCH_ABI64,    2 },
+    { "arm64_32", CPU_TYPE_ARM      | CPU_ARCH_ABI64_32, 1 },
+    { "ppc",      CPU_TYPE_POWERPC,                      0 },
+    { "ppc64",    CPU_TYPE_POWERPC  | CPU_ARCH_ABI64,    0 },
+};
+
 // 0 = success
 // 1 = not a segment
 // N = fatal error
@@ -271,184 +537,844 @@ static int get_mapped_segment_range(mach_lc_t *cmd, bool use_sections, uint64_t
     return 0;
 }
 
-int main(int argc, const char **argv)
+#ifndef _WIN32
+static bool write_at(int fd, const void *buf, uint64_t len, uint64_t off)
 {
-    int retval = -1;
-    void *file = NULL,
-         *mem  = NULL;
-    size_t flen = 0,
-           mlen = 0,
-           fmax = 0,
-           smax = 0;
-    FILE *infile  = NULL,
-         *outfile = NULL;
-    vmacho_mode_t mode = Mode_Binary;
-    const char *oflags = "wbx",
-               *aname  = NULL;
-    bool use_sections  = true;
-    int r;
-
-    int aoff = 1;
-    for(; aoff < argc; ++aoff)
+    const uint8_t *p = buf;
+    while(len > 0)
     {
-        if(argv[aoff][0] != '-' || argv[aoff][1] == '\0')
-        {
-            break;
-        }
-        int curoff = aoff;
-        for(size_t i = 1; argv[curoff][i] != '\0'; ++i)
+        ssize_t w = pwrite(fd, p, len > 0x40000000 ? 0x40000000 : (size_t)len, (off_t)off);
+        if(w < 0)
         {
-            char c = argv[curoff][i];
-            switch(c)
+            if(errno == EINTR)
             {
-                case 'c':
-                    mode = Mode_HeadlessArray;
-                    break;
-                case 'C':
-                    if(argc - aoff < 4) // Don't want curoff here
-                    {
-                        LOG("-%c requires an argument", c);
-                        goto out;
-                    }
-                    mode = Mode_NamedArray;
-                    aname = argv[++aoff];
-                    break;
-                case 'f':
-                    oflags = "wb";
-                    break;
-                case 'm':
-                case 'M':
-                    if(argc - aoff < 4) // Don't want curoff here
-                    {
-                        LOG("-%c requires an argument", c);
-                        goto out;
-                    }
-                    const char *num = argv[++aoff];
-                    char *end = NULL;
-                    unsigned long long l = strtoull(num, &end, 0);
-                    if(*num == '\0' || *end != '\0')
-                    {
-                        LOG("Invalid argument to -%c: %s", c, num);
-                        goto out;
-                    }
-                    if(c == 'm')
-                        fmax = (size_t)l;
-                    else
-                        smax = (size_t)l;
-                    break;
-                case 's':
-                    use_sections = false;
-                    break;
-                default:
-                    LOG("Bad option: -%c", c);
-                    goto out;
+                continue;
             }
+            LOG("pwrite: %s", strerror(errno));
+            return false;
         }
+        p   += w;
+        len -= (uint64_t)w;
+        off += (uint64_t)w;
     }
-    if(argc - aoff != 2)
+    return true;
+}
+
+// Writes len bytes of the mapped input at off in the output, a piece at a time. Written pieces are
+// dropped from the mapping, so that they count against the page cache only and not our RSS too.
+static bool write_mapped(int fd, const void *src, uint64_t len, uint64_t off)
+{
+    uintptr_t pgmask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    const uint8_t *p = src;
+    while(len > 0)
     {
-        fprintf(stderr, "Usage: %s [-cf] [-C name] [-m max] [-M max] in out\n"
-                        "    -c      Output as headless C array\n"
-                        "    -C name Output as named C array\n"
-                        "    -f      Force (overwrite existing files)\n"
-                        "    -m max  Enforce max size of bytes for total file mapping\n"
-                        "    -M max  Enforce max size of bytes for total runtime size\n"
-                        "    -s      Use only segments for mapping, ignore sections\n"
-                        , argv[0]);
-        goto out;
+        uint64_t n = len > 0x800000 ? 0x800000 : len;
+        if(!write_at(fd, p, n, off))
+        {
+            return false;
+        }
+        uintptr_t lo = ((uintptr_t)p + pgmask) & ~pgmask,
+                  hi = ((uintptr_t)p + n) & ~pgmask;
+        if(hi > lo)
+        {
+            madvise((void*)lo, hi - lo, MADV_DONTNEED);
+        }
+        p   += n;
+        len -= n;
+        off += n;
     }
+    return true;
+}
+#endif
 
-    infile = strcmp(argv[aoff], "-") == 0 ? stdin : fopen(argv[aoff], "rb");
-    if(!infile)
+// C array output is formatted a whole row at a time into this much buffer, then written out in one go.
+#define ARRAY_BUF   0x100000
+#define ARRAY_ROW   (4 + 16 * 6)    // "    " and 16 times "0x00, ", with the last space a newline
+
+// Rows of len bytes, formatted in buf (ARRAY_BUF big). Only the last row may be short.
+static bool write_array(FILE *f, char *buf, const uint8_t *u, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    char hex[0x100][2];
+    for(size_t i = 0; i < 0x100; ++i)
     {
-        LOG("fopen(%s): %s", argv[aoff], strerror(errno));
-        goto out;
+        hex[i][0] = digits[i >> 4];
+        hex[i][1] = digits[i & 0xf];
     }
-    long cur = ftell(infile);
-    if(cur < 0)
+    size_t n = 0;
+    for(size_t i = 0; i < len; i += 0x10)
     {
-        LOG("ftell(cur): %s", strerror(errno));
-        goto out;
+        if(n > ARRAY_BUF - ARRAY_ROW)
+        {
+            if(fwrite(buf, 1, n, f) != n)
+            {
+                goto err;
+            }
+            n = 0;
+        }
+        size_t row = len - i < 0x10 ? len - i : 0x10;
+        char *p = buf + n;
+        memcpy(p, "    ", 4);
+        p += 4;
+        for(size_t j = 0; j < row; ++j, p += 6)
+        {
+            p[0] = '0';
+            p[1] = 'x';
+            p[2] = hex[u[i + j]][0];
+            p[3] = hex[u[i + j]][1];
+            p[4] = ',';
+            p[5] = ' ';
+        }
+        p[-1] = '\n';
+        n = p - buf;
     }
-    r = fseek(infile, 0, SEEK_END);
-    if(r != 0)
+    if(fwrite(buf, 1, n, f) != n)
     {
-        LOG("fseek(end): %s", strerror(errno));
-        goto out;
+        goto err;
     }
-    long end = ftell(infile);
-    if(end < 0)
+    return true;
+err:;
+    LOG("fwrite: %s", strerror(errno));
+    return false;
+}
+
+static bool seq_out(seq_t *s, const uint8_t *u, size_t len)
+{
+    s->pos += len;
+    if(!s->txt)
     {
-        LOG("ftell(end): %s", strerror(errno));
-        goto out;
+        if(fwrite(u, 1, len, s->f) != len)
+        {
+            LOG("fwrite: %s", strerror(errno));
+            return false;
+        }
+        return true;
     }
-    flen = (size_t)(end - cur);
-    r = fseek(infile, cur, SEEK_SET);
-    if(r != 0)
+    // Rows carry over from one piece to the next.
+    if(s->nrow)
     {
-        LOG("fseek(cur): %s", strerror(errno));
-        goto out;
+        size_t k = len < sizeof(s->row) - s->nrow ? len : sizeof(s->row) - s->nrow;
+        memcpy(s->row + s->nrow, u, k);
+        s->nrow += k;
+        u   += k;
+        len -= k;
+        if(s->nrow < sizeof(s->row))
+        {
+            return true;
+        }
+        if(!write_array(s->f, s->txt, s->row, sizeof(s->row)))
+        {
+            return false;
+        }
+        s->nrow = 0;
     }
-
-    if(flen < sizeof(uint32_t))
+    size_t full = len & ~(sizeof(s->row) - 1);
+    if(full && !write_array(s->f, s->txt, u, full))
     {
-        LOG("File too short for magic.");
-        goto out;
+        return false;
     }
-    file = malloc(flen);
-    if(!file)
+    memcpy(s->row, u + full, len - full);
+    s->nrow = len - full;
+    return true;
+}
+
+// Writes len bytes that go at off in the image, after zeroes up to there. Anything before pos already
+// went out as part of an overlapping range, and is skipped.
+static bool seq_at(seq_t *s, uint64_t off, const uint8_t *u, uint64_t len)
+{
+    static const uint8_t zero[0x4000];
+    while(s->pos < off)
     {
-        LOG("malloc(file): %s", strerror(errno));
-        goto out;
+        if(!seq_out(s, zero, off - s->pos > sizeof(zero) ? sizeof(zero) : (size_t)(off - s->pos)))
+        {
+            return false;
+        }
     }
-    if(fread(file, 1, flen, infile) != flen)
+    if(off + len <= s->pos)
     {
-        LOG("fread: %s", strerror(errno));
-        goto out;
+        return true;
     }
+    return seq_out(s, u + (s->pos - off), (size_t)(off + len - s->pos));
+}
 
-    uintptr_t ufile = (uintptr_t)file;
-    uint32_t magic = *(uint32_t*)file;
-    mach_lc_t *lcs = NULL;
-    uint32_t sizeofcmds = 0;
-    if(magic == MH_MAGIC)
+// Moves on to the next range every time one is all out, writing what came in for it early.
+static bool seq_drain(seq_t *s)
+{
+    for(; s->next < s->n; ++s->next)
     {
-        mach_hdr32_t *hdr = file;
-        if(flen < sizeof(*hdr) + hdr->sizeofcmds)
+        range_t *r = s->order[s->next];
+        if(!r->live)
         {
-            LOG("File too short for load commands.");
-            goto out;
+            r->live = true;
+            bool ok = seq_at(s, r->dst, r->held, r->got);
+            if(r->held)
+            {
+                free(r->held);
+                r->held = NULL;
+            }
+            if(!ok)
+            {
+                return false;
+            }
+        }
+        if(r->got < r->size)
+        {
+            break;
         }
-        lcs = (mach_lc_t*)(hdr + 1);
-        sizeofcmds = hdr->sizeofcmds;
     }
-    else if(magic == MH_MAGIC_64)
+    return true;
+}
+
+// Takes the next len bytes of r, writing them if it's r's turn, holding on to them until then otherwise.
+static bool seq_take(seq_t *s, range_t *r, const uint8_t *u, uint64_t len)
+{
+    if(r->live)
     {
-        mach_hdr64_t *hdr = file;
-        if(flen < sizeof(*hdr) + hdr->sizeofcmds)
+        if(!seq_at(s, r->dst + r->got, u, len))
         {
-            LOG("File too short for load commands.");
-            goto out;
+            return false;
         }
-        lcs = (mach_lc_t*)(hdr + 1);
-        sizeofcmds = hdr->sizeofcmds;
     }
     else
     {
-        LOG("Bad magic: %08llx", (unsigned long long)magic);
-        goto out;
+        if(!r->held && !(r->held = malloc((size_t)r->size)))
+        {
+            LOG("malloc: %s", strerror(errno));
+            return false;
+        }
+        memcpy(r->held + r->got, u, (size_t)len);
     }
+    r->got += len;
+    return r->got < r->size || seq_drain(s);
+}
 
-    uint64_t lowest    = ~0,
-             highest   =  0,
-             vmlowest  = ~0,
-             vmhighest =  0;
-    for(mach_lc_t *cmd = lcs, *end = (mach_lc_t*)((uintptr_t)cmd + sizeofcmds); cmd < end; cmd = (mach_lc_t*)((uintptr_t)cmd + cmd->cmdsize))
+static int order_cmp(const void *a, const void *b)
+{
+    uint64_t x = (*(range_t* const*)a)->dst,
+             y = (*(range_t* const*)b)->dst;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// To be called once the ranges won't move anymore.
+static bool seq_start(seq_t *s, range_t *r, size_t n)
+{
+    s->order = malloc((n + 1) * sizeof(*s->order));
+    if(!s->order)
     {
-        if((uintptr_t)cmd + sizeof(*cmd) > (uintptr_t)end || (uintptr_t)cmd + cmd->cmdsize > (uintptr_t)end || (uintptr_t)cmd + cmd->cmdsize < (uintptr_t)cmd)
+        LOG("malloc: %s", strerror(errno));
+        return false;
+    }
+    for(size_t i = 0; i < n; ++i)
+    {
+        s->order[i] = &r[i];
+    }
+    s->n = n;
+    qsort(s->order, n, sizeof(*s->order), order_cmp);
+    return seq_drain(s);
+}
+
+// Zeroes up to the end of the image, and the last row.
+static bool seq_end(seq_t *s, uint64_t len)
+{
+    if(!seq_at(s, len, NULL, 0))
+    {
+        return false;
+    }
+    return !s->txt || s->nrow == 0 || write_array(s->f, s->txt, s->row, s->nrow);
+}
+
+static void seq_free(seq_t *s)
+{
+    for(size_t i = 0; i < s->n; ++i)
+    {
+        if(s->order[i]->held) free(s->order[i]->held);
+    }
+    if(s->order) free(s->order);
+    if(s->txt) free(s->txt);
+}
+
+// ELF object output: the header, then the image as .rodata, followed by its size as a uint64_t.
+// Everything after the image is built here as the tail, so the image itself can be written like in binary mode.
+static const char elf_shstrtab[] = "\0.rodata\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+
+// Machines for -e, by the names toolchains use for them. The flags are those of the usual ABI,
+// since linkers refuse to mix objects that disagree on e.g. the float ABI.
+static const struct
+{
+    const char *name;
+    elf_target_t target;
+} elf_targets[] =
+{
+    { "aarch64", { EM_AARCH64, true,  0 } },
+    { "arm64",   { EM_AARCH64, true,  0 } },
+    { "x86_64",  { EM_X86_64,  true,  0 } },
+    { "amd64",   { EM_X86_64,  true,  0 } },
+    { "i386",    { EM_386,     false, 0 } },
+    { "arm",     { EM_ARM,     false, EF_ARM_EABI_VER5 } },
+    { "riscv64", { EM_RISCV,   true,  EF_RISCV_FLOAT_ABI_DOUBLE } },
+    { "riscv32", { EM_RISCV,   false, 0 } },
+};
+
+// The machine vmacho itself was built for, if it's one of the above.
+static const char* elf_host(void)
+{
+#if defined(__aarch64__) || defined(_M_ARM64)
+    return "aarch64";
+#elif defined(__x86_64__) || defined(_M_X64)
+    return "x86_64";
+#elif defined(__i386__) || defined(_M_IX86)
+    return "i386";
+#elif defined(__arm__) || defined(_M_ARM)
+    return "arm";
+#elif defined(__riscv) && __riscv_xlen == 64
+    return "riscv64";
+#elif defined(__riscv)
+    return "riscv32";
+#else
+    return NULL;
+#endif
+}
+
+// A name from elf_targets, or an e_machine number, which gets a 64bit object without flags.
+static bool elf_target(const char *str, elf_target_t *tgt)
+{
+    for(size_t i = 0; i < sizeof(elf_targets) / sizeof(elf_targets[0]); ++i)
+    {
+        if(strcmp(str, elf_targets[i].name) == 0)
         {
-            LOG("Bad LC: 0x%llx", (unsigned long long)((uintptr_t)cmd - ufile));
-            goto out;
+            *tgt = elf_targets[i].target;
+            return true;
+        }
+    }
+    char *end = NULL;
+    unsigned long long l = strtoull(str, &end, 0);
+    if(*str == '\0' || *end != '\0' || l == 0 || l > 0xffff)
+    {
+        return false;
+    }
+    *tgt = (elf_target_t){ .machine = (uint16_t)l, .is64 = true, .flags = 0 };
+    return true;
+}
+
+// Builds the header, padded so the image starts 16-byte aligned, into head (at most ELF_HEAD bytes),
+// and the tail. Both classes share the layout, only the sizes of the tables differ.
+#define ELF_HEAD 0x40
+
+static bool elf_make(const char *name, uint64_t size, const elf_target_t *tgt, uint8_t *head, size_t *headlen, uint8_t **tail, size_t *taillen)
+{
+    bool is64 = tgt->is64;
+    size_t symsize = is64 ? sizeof(elf64_sym_t) : sizeof(elf32_sym_t),
+           shsize  = is64 ? sizeof(elf64_shdr_t) : sizeof(elf32_shdr_t);
+    size_t nlen    = strlen(name),
+           strsize = 1 + (nlen + 1) + (nlen + sizeof("_size"));
+    uint64_t szoff = (size + 7) & ~7ULL,       // Of the size, within .rodata
+             rooff = ELF_HEAD,
+             syoff = rooff + szoff + 8,
+             stoff = syoff + 3 * symsize,
+             shoff = stoff + strsize,
+             sh    = (shoff + sizeof(elf_shstrtab) + 7) & ~7ULL,
+             base  = rooff + size,              // Of the tail, within the file
+             end   = sh + 6 * shsize;
+    if(!is64 && end > UINT32_MAX)
+    {
+        LOG("Image too large for a 32bit ELF object: 0x%llx", (unsigned long long)size);
+        return false;
+    }
+    uint8_t *t = calloc(1, (size_t)(end - base));
+    if(!t)
+    {
+        LOG("calloc: %s", strerror(errno));
+        return false;
+    }
+    memcpy(t + (rooff + szoff - base), &size, sizeof(size));
+
+    char *str = (char*)(t + (stoff - base));
+    memcpy(str + 1, name, nlen);
+    memcpy(str + 1 + nlen + 1, name, nlen);
+    memcpy(str + 1 + nlen + 1 + nlen, "_size", sizeof("_size"));
+    memcpy(t + (shoff - base), elf_shstrtab, sizeof(elf_shstrtab));
+
+    // The tail needn't be aligned in memory, so the tables are copied in.
+    memset(head, 0, ELF_HEAD);
+    const uint8_t ident[16] = { 0x7f, 'E', 'L', 'F', is64 ? 2 : 1 /* 64 or 32bit */, 1 /* little endian */, 1 /* version */ };
+    if(is64)
+    {
+        elf64_sym_t sym[3] = { { 0 } };
+        sym[1] = (elf64_sym_t){ .name = 1,            .info = STB_GLOBAL_OBJECT, .shndx = 1, .value = 0,     .size = size };
+        sym[2] = (elf64_sym_t){ .name = 1 + nlen + 1, .info = STB_GLOBAL_OBJECT, .shndx = 1, .value = szoff, .size = 8 };
+        memcpy(t + (syoff - base), sym, sizeof(sym));
+
+        elf64_shdr_t sec[6] = { { 0 } };
+        sec[1] = (elf64_shdr_t){ .name = 1,  .type = SHT_PROGBITS, .flags = SHF_ALLOC, .offset = rooff, .size = szoff + 8, .addralign = 16 };
+        sec[2] = (elf64_shdr_t){ .name = 9,  .type = SHT_SYMTAB,   .offset = syoff, .size = 3 * sizeof(elf64_sym_t), .link = 3, .info = 1, .addralign = 8, .entsize = sizeof(elf64_sym_t) };
+        sec[3] = (elf64_shdr_t){ .name = 17, .type = SHT_STRTAB,   .offset = stoff, .size = strsize, .addralign = 1 };
+        sec[4] = (elf64_shdr_t){ .name = 25, .type = SHT_STRTAB,   .offset = shoff, .size = sizeof(elf_shstrtab), .addralign = 1 };
+        // Empty, it just says that the stack needn't be executable.
+        sec[5] = (elf64_shdr_t){ .name = 35, .type = SHT_PROGBITS, .offset = sh, .addralign = 1 };
+        memcpy(t + (sh - base), sec, sizeof(sec));
+
+        elf64_hdr_t hdr =
+        {
+            .type      = 1, // Relocatable
+            .machine   = tgt->machine,
+            .version   = 1,
+            .shoff     = sh,
+            .flags     = tgt->flags,
+            .ehsize    = sizeof(hdr),
+            .shentsize = sizeof(elf64_shdr_t),
+            .shnum     = 6,
+            .shstrndx  = 4,
+        };
+        memcpy(hdr.ident, ident, sizeof(ident));
+        memcpy(head, &hdr, sizeof(hdr));
+    }
+    else
+    {
+        elf32_sym_t sym[3] = { { 0 } };
+        sym[1] = (elf32_sym_t){ .name = 1,            .info = STB_GLOBAL_OBJECT, .shndx = 1, .value = 0,               .size = (uint32_t)size };
+        sym[2] = (elf32_sym_t){ .name = 1 + nlen + 1, .info = STB_GLOBAL_OBJECT, .shndx = 1, .value = (uint32_t)szoff, .size = 8 };
+        memcpy(t + (syoff - base), sym, sizeof(sym));
+
+        elf32_shdr_t sec[6] = { { 0 } };
+        sec[1] = (elf32_shdr_t){ .name = 1,  .type = SHT_PROGBITS, .flags = SHF_ALLOC, .offset = (uint32_t)rooff, .size = (uint32_t)(szoff + 8), .addralign = 16 };
+        sec[2] = (elf32_shdr_t){ .name = 9,  .type = SHT_SYMTAB,   .offset = (uint32_t)syoff, .size = 3 * sizeof(elf32_sym_t), .link = 3, .info = 1, .addralign = 4, .entsize = sizeof(elf32_sym_t) };
+        sec[3] = (elf32_shdr_t){ .name = 17, .type = SHT_STRTAB,   .offset = (uint32_t)stoff, .size = (uint32_t)strsize, .addralign = 1 };
+        sec[4] = (elf32_shdr_t){ .name = 25, .type = SHT_STRTAB,   .offset = (uint32_t)shoff, .size = sizeof(elf_shstrtab), .addralign = 1 };
+        sec[5] = (elf32_shdr_t){ .name = 35, .type = SHT_PROGBITS, .offset = (uint32_t)sh, .addralign = 1 };
+        memcpy(t + (sh - base), sec, sizeof(sec));
+
+        elf32_hdr_t hdr =
+        {
+            .type      = 1,
+            .machine   = tgt->machine,
+            .version   = 1,
+            .shoff     = (uint32_t)sh,
+            .flags     = tgt->flags,
+            .ehsize    = sizeof(hdr),
+            .shentsize = sizeof(elf32_shdr_t),
+            .shnum     = 6,
+            .shstrndx  = 4,
+        };
+        memcpy(hdr.ident, ident, sizeof(ident));
+        memcpy(head, &hdr, sizeof(hdr));
+    }
+    *headlen = (size_t)rooff;
+    *tail = t;
+    *taillen = (size_t)(end - base);
+    return true;
+}
+
+// Assembler output: a stub that pulls in the image from a separate file, for both ELF and Mach-O.
+// It needs the C preprocessor, i.e. a .S file. The assembler looks for the image in its working
+// directory and the ones given with -I, so only its file name goes in.
+static bool write_stub(FILE *f, const char *name, const char *path, uint64_t size)
+{
+    for(const char *c = path; *c; ++c)
+    {
+        if(*c == '/' || *c == '\\')
+        {
+            path = c + 1;
+        }
+    }
+    if(fprintf(f, "#ifdef __APPLE__\n"
+                  "#   define SYM(name) _##name\n"
+                  "    .const\n"
+                  "#else\n"
+                  "#   define SYM(name) name\n"
+                  "    .section .rodata\n"
+                  "#endif\n"
+                  "    .globl SYM(%s)\n"
+                  "    .globl SYM(%s_size)\n"
+                  "    .p2align 4\n"
+                  "SYM(%s):\n"
+                  "    .incbin \"", name, name, name) < 0)
+    {
+        goto err;
+    }
+    for(const char *c = path; *c; ++c)
+    {
+        if((*c == '"' || *c == '\\') && fputc('\\', f) == EOF)
+        {
+            goto err;
+        }
+        if(fputc(*c, f) == EOF)
+        {
+            goto err;
+        }
+    }
+    if(fprintf(f, "\"\n"
+                  "    .p2align 3\n"
+                  "SYM(%s_size):\n"
+                  "    .quad 0x%llx\n"
+                  "#ifndef __APPLE__\n"
+                  "    .type %s, %%object\n"
+                  "    .size %s, 0x%llx\n"
+                  "    .type %s_size, %%object\n"
+                  "    .size %s_size, 8\n"
+                  "    .section .note.GNU-stack, \"\", %%progbits\n"
+                  "#endif\n", name, (unsigned long long)size, name, name, (unsigned long long)size, name, name) < 0)
+    {
+        goto err;
+    }
+    return true;
+err:;
+    LOG("fprintf: %s", strerror(errno));
+    return false;
+}
+
+static uint32_t swap32(uint32_t v)
+{
+    return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+static uint64_t swap64(uint64_t v)
+{
+    return ((uint64_t)swap32((uint32_t)v) << 32) | swap32((uint32_t)(v >> 32));
+}
+
+static void arch_name(uint32_t cputype, uint32_t cpusubtype, char *buf, size_t len)
+{
+    for(size_t i = 0; i < sizeof(arch_names)/sizeof(arch_names[0]); ++i)
+    {
+        if(arch_names[i].cputype == cputype && arch_names[i].cpusubtype == (cpusubtype & ~CPU_SUBTYPE_MASK))
+        {
+            snprintf(buf, len, "%s", arch_names[i].name);
+            return;
+        }
+    }
+    snprintf(buf, len, "cpu%x_%x", cputype, cpusubtype & ~CPU_SUBTYPE_MASK);
+}
+
+// Names match one subtype only, numbers match any.
+static bool arch_parse(const char *str, uint32_t *cputype, uint32_t *cpusubtype)
+{
+    for(size_t i = 0; i < sizeof(arch_names)/sizeof(arch_names[0]); ++i)
+    {
+        if(strcmp(arch_names[i].name, str) == 0)
+        {
+            *cputype    = arch_names[i].cputype;
+            *cpusubtype = arch_names[i].cpusubtype;
+            return true;
+        }
+    }
+    char *end = NULL;
+    unsigned long long l = strtoull(str, &end, 0);
+    if(*str == '\0' || *end != '\0' || l > UINT32_MAX)
+    {
+        return false;
+    }
+    *cputype    = (uint32_t)l;
+    *cpusubtype = CPU_SUBTYPE_ANY;
+    return true;
+}
+
+// A thin Mach-O is a single slice spanning the whole file.
+// file only needs to hold the headers, flen is just for bounds.
+static bool get_slices(const void *file, size_t flen, slice_t **slices, uint32_t *nslices)
+{
+    const fat_hdr_t *fat = file;
+    uint32_t magic = swap32(fat->magic),
+             n     = 1;
+    size_t asize = magic == FAT_MAGIC_64 ? sizeof(fat_arch64_t) : sizeof(fat_arch32_t);
+    bool thin = magic != FAT_MAGIC && magic != FAT_MAGIC_64;
+    if(!thin)
+    {
+        if(flen < sizeof(*fat))
+        {
+            LOG("File too short for fat header.");
+            return false;
+        }
+        n = swap32(fat->nfat_arch);
+        if(n == 0 || (flen - sizeof(*fat)) / asize < n)
+        {
+            LOG("Bad fat arch count: %u", n);
+            return false;
+        }
+    }
+    slice_t *s = calloc(n, sizeof(*s));
+    if(!s)
+    {
+        LOG("calloc: %s", strerror(errno));
+        return false;
+    }
+    if(thin)
+    {
+        const mach_hdr32_t *hdr = file;
+        if(flen >= sizeof(*hdr))
+        {
+            s[0].cputype    = hdr->cputype;
+            s[0].cpusubtype = hdr->cpusubtype;
+        }
+        s[0].size = flen;
+    }
+    for(uint32_t i = 0; !thin && i < n; ++i)
+    {
+        uint64_t off, size;
+        if(magic == FAT_MAGIC_64)
+        {
+            const fat_arch64_t *arch = (const fat_arch64_t*)(fat + 1) + i;
+            s[i].cputype    = swap32(arch->cputype);
+            s[i].cpusubtype = swap32(arch->cpusubtype);
+            off  = swap64(arch->offset);
+            size = swap64(arch->size);
+        }
+        else
+        {
+            const fat_arch32_t *arch = (const fat_arch32_t*)(fat + 1) + i;
+            s[i].cputype    = swap32(arch->cputype);
+            s[i].cpusubtype = swap32(arch->cpusubtype);
+            off  = swap32(arch->offset);
+            size = swap32(arch->size);
+        }
+        if(off > flen || size > flen - off)
+        {
+            LOG("Bad fat arch %u: offset 0x%llx, size 0x%llx", i, (unsigned long long)off, (unsigned long long)size);
+            free(s);
+            return false;
+        }
+        s[i].offset = off;
+        s[i].size   = size;
+    }
+    for(uint32_t i = 0; i < n; ++i)
+    {
+        arch_name(s[i].cputype, s[i].cpusubtype, s[i].name, sizeof(s[i].name));
+    }
+    *slices  = s;
+    *nslices = n;
+    return true;
+}
+
+// foo.bin -> foo.arm64.bin, foo -> foo.arm64
+static char* slice_path(const char *path, const char *name)
+{
+    size_t len = strlen(path),
+           ext = len;
+    for(size_t i = len; i > 0; --i)
+    {
+        char c = path[i - 1];
+        if(c == '/' || c == '\\')
+        {
+            break;
+        }
+        // Not for dotfiles.
+        if(c == '.' && i > 1 && path[i - 2] != '/' && path[i - 2] != '\\')
+        {
+            ext = i - 1;
+            break;
+        }
+    }
+    size_t nlen = strlen(name);
+    char *out = malloc(len + 1 + nlen + 1);
+    if(!out)
+    {
+        LOG("malloc: %s", strerror(errno));
+        return NULL;
+    }
+    memcpy(out, path, ext);
+    out[ext] = '.';
+    memcpy(out + ext + 1, name, nlen);
+    memcpy(out + ext + 1 + nlen, path + ext, len - ext + 1);
+    return out;
+}
+
+#define STREAM_BUF  0x100000
+
+static bool stream_read(stream_t *s, void *buf, size_t len)
+{
+    size_t n = fread(buf, 1, len, s->f);
+    s->pos += n;
+    if(n != len)
+    {
+        if(ferror(s->f))
+            LOG("fread: %s", strerror(errno));
+        else
+            LOG("Input ends early at 0x%llx", (unsigned long long)s->pos);
+        return false;
+    }
+    return true;
+}
+
+// Streams can't seek, so this reads up to pos and drops it.
+static bool stream_skip(stream_t *s, uint64_t pos)
+{
+    uint8_t buf[0x4000];
+    while(s->pos < pos)
+    {
+        if(!stream_read(s, buf, pos - s->pos > sizeof(buf) ? sizeof(buf) : (size_t)(pos - s->pos)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const range_t*)a)->fileoff,
+             y = ((const range_t*)b)->fileoff;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Copies the bytes at pos to every range that has them, into img at imgoff, or seq if there's no img.
+static bool put_ranges(range_t *r, size_t n, const uint8_t *src, uint64_t pos, size_t len, FILE *img, uint64_t imgoff, seq_t *seq)
+{
+#ifdef _WIN32
+    // Always into seq here.
+    (void)img;
+    (void)imgoff;
+#endif
+    for(size_t i = 0; i < n && r[i].fileoff < pos + len; ++i)
+    {
+        if(r[i].fileoff + r[i].size <= pos)
+        {
+            continue;
+        }
+        uint64_t lo = r[i].fileoff > pos ? r[i].fileoff : pos,
+                 hi = r[i].fileoff + r[i].size < pos + len ? r[i].fileoff + r[i].size : pos + len;
+#ifndef _WIN32
+        if(img)
+        {
+            if(!write_at(fileno(img), src + (lo - pos), hi - lo, imgoff + r[i].dst + (lo - r[i].fileoff)))
+            {
+                return false;
+            }
+            continue;
+        }
+#endif
+        if(!seq_take(seq, &r[i], src + (lo - pos), hi - lo))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Copies the ranges out of a stream that has just gone past the header and load commands in hdr.
+// The input is consumed front to back and each piece goes to every range that has it as it goes
+// by. Only the header needs to be kept, and with seq, ranges that come in before their turn.
+static bool stream_ranges(stream_t *s, const uint8_t *hdr, size_t hdrlen, range_t *r, size_t n, FILE *img, uint64_t imgoff, seq_t *seq)
+{
+    bool ok = false;
+    uint8_t *buf = NULL;
+    uint64_t base = s->pos - hdrlen,
+             end  = 0;
+    qsort(r, n, sizeof(*r), range_cmp);
+    if(seq && !seq_start(seq, r, n))
+    {
+        goto out;
+    }
+    for(size_t i = 0; i < n; ++i)
+    {
+        if(r[i].fileoff + r[i].size > end)
+        {
+            end = r[i].fileoff + r[i].size;
+        }
+    }
+    if(!put_ranges(r, n, hdr, 0, hdrlen, img, imgoff, seq))
+    {
+        goto out;
+    }
+    buf = malloc(STREAM_BUF);
+    if(!buf)
+    {
+        LOG("malloc: %s", strerror(errno));
+        goto out;
+    }
+    while(s->pos - base < end)
+    {
+        uint64_t pos = s->pos - base;
+        size_t len = end - pos > STREAM_BUF ? STREAM_BUF : (size_t)(end - pos);
+        if(!stream_read(s, buf, len))
+        {
+            // Without a length up front, this is where a segment past the end of the input shows.
+            for(size_t i = 0; !ferror(s->f) && i < n; ++i)
+            {
+                if(r[i].fileoff + r[i].size > pos + len)
+                {
+                    LOG("Bad segment: 0x%llx", (unsigned long long)r[i].cmd);
+                    break;
+                }
+            }
+            goto out;
+        }
+        if(!put_ranges(r, n, buf, pos, len, img, imgoff, seq))
+        {
+            goto out;
+        }
+    }
+    ok = true;
+out:;
+    if(buf) free(buf);
+    return ok;
+}
+
+// Extracts the Mach-O in file to outpath, "-" being stdout.
+// With a stream, file only holds the header and load commands, and the rest is read from the stream.
+// flen is then LEN_UNKNOWN for a thin Mach-O, and segments are only checked against it as they're read.
+static bool extract(const vmacho_opts_t *opt, const void *file, size_t flen, stream_t *stream, const char *outpath)
+{
+    bool ok = false;
+    seq_t seq = { 0 };
+    range_t *ranges = NULL;
+    size_t nranges = 0;
+    size_t mlen = 0;
+    FILE *outfile = NULL,
+         *imgfile = NULL; // Where the image goes, outfile unless that's an assembler stub
+    char *imgpath = NULL;
+    uint8_t *tail = NULL;
+    size_t taillen = 0;
+    uint8_t ehdr[ELF_HEAD];
+    size_t ehdrlen = 0;
+    bool sparse = false; // Binary output goes straight to its offset in imgfile
+    int r;
+
+    if(flen < sizeof(uint32_t))
+    {
+        LOG("File too short for magic.");
+        goto out;
+    }
+    uintptr_t ufile = (uintptr_t)file;
+    uint32_t magic = *(const uint32_t*)file;
+    mach_lc_t *lcs = NULL;
+    uint32_t sizeofcmds = 0;
+    if(magic == MH_MAGIC)
+    {
+        const mach_hdr32_t *hdr = file;
+        if(flen < sizeof(*hdr) || flen - sizeof(*hdr) < hdr->sizeofcmds)
+        {
+            LOG("File too short for load commands.");
+            goto out;
+        }
+        lcs = (mach_lc_t*)(hdr + 1);
+        sizeofcmds = hdr->sizeofcmds;
+    }
+    else if(magic == MH_MAGIC_64)
+    {
+        const mach_hdr64_t *hdr = file;
+        if(flen < sizeof(*hdr) || flen - sizeof(*hdr) < hdr->sizeofcmds)
+        {
+            LOG("File too short for load commands.");
+            goto out;
+        }
+        lcs = (mach_lc_t*)(hdr + 1);
+        sizeofcmds = hdr->sizeofcmds;
+    }
+    else
+    {
+        LOG("Bad magic: %08llx", (unsigned long long)magic);
+        goto out;
+    }
+
+    uint64_t lowest    = ~0,
+             highest   =  0,
+             vmlowest  = ~0,
+             vmhighest =  0;
+    for(mach_lc_t *cmd = lcs, *end = (mach_lc_t*)((uintptr_t)cmd + sizeofcmds); cmd < end; cmd = (mach_lc_t*)((uintptr_t)cmd + cmd->cmdsize))
+    {
+        if((uintptr_t)cmd + sizeof(*cmd) > (uintptr_t)end || (uintptr_t)cmd + cmd->cmdsize > (uintptr_t)end || (uintptr_t)cmd + cmd->cmdsize < (uintptr_t)cmd)
+        {
+            LOG("Bad LC: 0x%llx", (unsigned long long)((uintptr_t)cmd - ufile));
+            goto out;
         }
 
         uint64_t vmaddr  = 0,
@@ -456,7 +1382,7 @@ int main(int argc, const char **argv)
                  size    = 0,
                  vmbase  = 0,
                  vmsize  = 0;
-        r = get_mapped_segment_range(cmd, use_sections, &vmaddr, &fileoff, &size, &vmbase, &vmsize);
+        r = get_mapped_segment_range(cmd, opt->use_sections, &vmaddr, &fileoff, &size, &vmbase, &vmsize);
         switch(r)
         {
             case 0:
@@ -479,7 +1405,7 @@ int main(int argc, const char **argv)
             continue;
         }
         uint64_t off = fileoff + size;
-        if(off > flen || off < fileoff)
+        if(off < fileoff || (flen != LEN_UNKNOWN && off > flen))
         {
             LOG("Bad segment: 0x%llx", (unsigned long long)((uintptr_t)cmd - ufile));
             goto out;
@@ -502,96 +1428,986 @@ int main(int argc, const char **argv)
         goto out;
     }
     mlen = (size_t)(highest - lowest);
-    if(fmax > 0 && mlen > fmax)
+    if(opt->fmax > 0 && mlen > opt->fmax)
     {
-        LOG("Filemap size is too large: max 0x%zx, have 0x%zx", fmax, mlen);
+        LOG("Filemap size is too large: max 0x%zx, have 0x%zx", opt->fmax, mlen);
         goto out;
     }
-    if(smax > 0 && (vmhighest - vmlowest) > smax)
+    if(opt->smax > 0 && (vmhighest - vmlowest) > opt->smax)
     {
-        LOG("Runtime size is too large: max 0x%zx, have 0x%zx", smax, (size_t)(vmhighest - vmlowest));
+        LOG("Runtime size is too large: max 0x%zx, have 0x%zx", opt->smax, (size_t)(vmhighest - vmlowest));
         goto out;
     }
-    mem = malloc(mlen);
-    if(!mem)
+    size_t olen = strlen(outpath);
+    if(opt->mode == Mode_Incbin && (olen < 3 || strcmp(outpath + olen - 2, ".S") != 0))
     {
-        LOG("malloc: %s", strerror(errno));
+        LOG("Assembler stubs need the C preprocessor, so %s has to end in .S", outpath);
         goto out;
     }
-    memset(mem, 0, mlen);
-    for(mach_lc_t *cmd = lcs, *end = (mach_lc_t*)((uintptr_t)cmd + sizeofcmds); cmd < end; cmd = (mach_lc_t*)((uintptr_t)cmd + cmd->cmdsize))
+    outfile = strcmp(outpath, "-") == 0 ? stdout : fopen(outpath, opt->oflags);
+    if(!outfile)
     {
-        uint64_t vmaddr  = 0,
-                 fileoff = 0,
-                 size    = 0;
-        r = get_mapped_segment_range(cmd, use_sections, &vmaddr, &fileoff, &size, NULL, NULL);
-        switch(r)
+        LOG("fopen(%s): %s", outpath, strerror(errno));
+        goto out;
+    }
+    imgfile = outfile;
+    if(opt->mode == Mode_Incbin)
+    {
+        // foo.S -> foo.bin
+        olen -= 2;
+        imgpath = malloc(olen + sizeof(".bin"));
+        if(!imgpath)
         {
-            case 0:
-                break;
-            case 1:
-                continue;
-            default:
-                LOG("get_mapped_segment_range returned error: %d", r);
-                goto out;
+            LOG("malloc(imgpath): %s", strerror(errno));
+            goto out;
         }
-        if(!size)
+        memcpy(imgpath, outpath, olen);
+        memcpy(imgpath + olen, ".bin", sizeof(".bin"));
+        imgfile = fopen(imgpath, opt->oflags);
+        if(!imgfile)
         {
-            continue;
+            LOG("fopen(%s): %s", imgpath, strerror(errno));
+            goto out;
         }
-        memcpy((void*)((uintptr_t)mem + (vmaddr - lowest)), (void*)(ufile + fileoff), size);
     }
-
-    outfile = strcmp(argv[aoff + 1], "-") == 0 ? stdout : fopen(argv[aoff + 1], oflags);
-    if(!outfile)
+    // Offset of the image in imgfile.
+    uint64_t imgoff = 0;
+    if(opt->mode == Mode_Elf)
     {
-        LOG("fopen(%s): %s", argv[aoff + 1], strerror(errno));
-        goto out;
+        if(!elf_make(opt->aname, mlen, &opt->elf, ehdr, &ehdrlen, &tail, &taillen))
+        {
+            goto out;
+        }
+        imgoff = ehdrlen;
     }
-
-    if(mode == Mode_Binary)
+    bool raw = opt->mode == Mode_Binary || opt->mode == Mode_Elf || opt->mode == Mode_Incbin;
+#ifndef _WIN32
+    struct stat st;
+    // Sized up front, so that the gaps between segments stay holes.
+    if(raw && imgfile != stdout && fstat(fileno(imgfile), &st) == 0 && S_ISREG(st.st_mode))
     {
-        if(fwrite(mem, 1, mlen, outfile) != mlen)
+        if(ftruncate(fileno(imgfile), (off_t)(imgoff + mlen + taillen)) != 0)
         {
-            LOG("fwrite: %s", strerror(errno));
+            LOG("ftruncate: %s", strerror(errno));
             goto out;
         }
+        sparse = true;
     }
-    else
+#endif
+    if(!sparse)
     {
-        r = 0;
-        if(mode == Mode_NamedArray)
+        // Front to back, so whatever comes before the image goes out first.
+        seq.f = imgfile;
+        if(!raw && !(seq.txt = malloc(ARRAY_BUF)))
         {
-            r = fprintf(outfile, "unsigned char %s[] = {\n", aname);
+            LOG("malloc: %s", strerror(errno));
+            goto out;
         }
-        if(r >= 0)
+        if(opt->mode == Mode_Elf && fwrite(ehdr, 1, ehdrlen, imgfile) != ehdrlen)
         {
-            uint8_t *u = mem;
-            for(size_t i = 0; i < mlen; ++i)
-            {
-                r = fprintf(outfile, "%s0x%02x,%c", i % 0x10 == 0 ? "    " : "", u[i], (i % 0x10 == 0xf || i == mlen - 1) ? '\n' : ' ');
-                if(r < 0) break;
-            }
+            LOG("fwrite: %s", strerror(errno));
+            goto out;
         }
-        if(mode == Mode_NamedArray && r >= 0)
+        if(opt->mode == Mode_NamedArray && fprintf(outfile, "unsigned char %s[] = {\n", opt->aname) < 0)
         {
-            r = fprintf(outfile, "};\n");
+            LOG("fprintf: %s", strerror(errno));
+            goto out;
         }
-        if(r < 0)
+    }
+    if(stream || !sparse)
+    {
+        ranges = malloc((sizeofcmds / sizeof(mach_lc_t) + 1) * sizeof(*ranges));
+        if(!ranges)
         {
-            LOG("fprintf: %s", strerror(errno));
+            LOG("malloc(ranges): %s", strerror(errno));
             goto out;
         }
     }
-    fflush(outfile); // In case of stdout
-
-    LOG("Done, base address: 0x%llx", (unsigned long long)lowest);
-    retval = 0;
-
-out:;
-    if(outfile && outfile != stdout) fclose(outfile);
-    if(mem) free(mem);
+    for(mach_lc_t *cmd = lcs, *end = (mach_lc_t*)((uintptr_t)cmd + sizeofcmds); cmd < end; cmd = (mach_lc_t*)((uintptr_t)cmd + cmd->cmdsize))
+    {
+        uint64_t vmaddr  = 0,
+                 fileoff = 0,
+                 size    = 0;
+        r = get_mapped_segment_range(cmd, opt->use_sections, &vmaddr, &fileoff, &size, NULL, NULL);
+        switch(r)
+        {
+            case 0:
+                break;
+            case 1:
+                continue;
+            default:
+                LOG("get_mapped_segment_range returned error: %d", r);
+                goto out;
+        }
+        if(!size)
+        {
+            continue;
+        }
+        if(ranges)
+        {
+            ranges[nranges++] = (range_t){ .fileoff = fileoff, .size = size, .dst = vmaddr - lowest, .cmd = (uintptr_t)cmd - ufile };
+            continue;
+        }
+#ifndef _WIN32
+        if(!write_mapped(fileno(imgfile), (void*)(ufile + fileoff), size, imgoff + (vmaddr - lowest)))
+        {
+            goto out;
+        }
+#endif
+    }
+    if(stream)
+    {
+        if(!stream_ranges(stream, file, (uintptr_t)lcs + sizeofcmds - ufile, ranges, nranges, sparse ? imgfile : NULL, imgoff, sparse ? NULL : &seq))
+        {
+            goto out;
+        }
+    }
+    else if(!sparse)
+    {
+        // Everything is here already, so taking the ranges in image order never holds on to any.
+        if(!seq_start(&seq, ranges, nranges))
+        {
+            goto out;
+        }
+        for(size_t i = 0; i < nranges; ++i)
+        {
+            if(!seq_take(&seq, seq.order[i], (const uint8_t*)file + seq.order[i]->fileoff, seq.order[i]->size))
+            {
+                goto out;
+            }
+        }
+    }
+    if(!sparse && !seq_end(&seq, mlen))
+    {
+        goto out;
+    }
+
+    if(raw)
+    {
+#ifndef _WIN32
+        if(sparse)
+        {
+            if(opt->mode == Mode_Elf && (!write_at(fileno(imgfile), ehdr, ehdrlen, 0) || !write_at(fileno(imgfile), tail, taillen, imgoff + mlen)))
+            {
+                goto out;
+            }
+        }
+        else
+#endif
+        if(opt->mode == Mode_Elf && fwrite(tail, 1, taillen, imgfile) != taillen)
+        {
+            LOG("fwrite: %s", strerror(errno));
+            goto out;
+        }
+        if(opt->mode == Mode_Incbin && !write_stub(outfile, opt->aname, imgpath, mlen))
+        {
+            goto out;
+        }
+    }
+    else if(opt->mode == Mode_NamedArray && fprintf(outfile, "};\n") < 0)
+    {
+        LOG("fprintf: %s", strerror(errno));
+        goto out;
+    }
+    fflush(outfile); // In case of stdout
+
+    LOG("Done, base address: 0x%llx", (unsigned long long)lowest);
+    ok = true;
+
+out:;
+    if(imgfile && imgfile != outfile) fclose(imgfile);
+    if(outfile && outfile != stdout) fclose(outfile);
+    if(imgpath) free(imgpath);
+    if(tail) free(tail);
+    seq_free(&seq); // Before the ranges it points to
+    if(ranges) free(ranges);
+    return ok;
+}
+
+static void* extract_slice(void *arg)
+{
+    slice_t *sl = arg;
+    const char *prev = log_what;
+    log_what = sl->what;
+    sl->ok = extract(sl->opt, sl->file, (size_t)sl->size, NULL, sl->out);
+    log_what = prev;
+    return NULL;
+}
+
+static int slice_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const slice_t*)a)->offset,
+             y = ((const slice_t*)b)->offset;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Extracts sl from a stream that hasn't gone past its start yet, except for the npre bytes in pre,
+// which are what the stream has read so far.
+static bool stream_extract(const vmacho_opts_t *opt, stream_t *s, const slice_t *sl, const uint8_t *pre, size_t npre, const char *outpath)
+{
+    bool ok = false;
+    uint8_t *buf = NULL;
+    mach_hdr32_t hdr;
+    size_t have = 0;
+    if(s->pos > sl->offset)
+    {
+        have = (size_t)(s->pos - sl->offset);
+        if(s->pos != npre || have > sizeof(hdr))
+        {
+            LOG("Slice at 0x%llx overlaps the one before it", (unsigned long long)sl->offset);
+            goto out;
+        }
+        memcpy(&hdr, pre + sl->offset, have);
+    }
+    if(!stream_skip(s, sl->offset) || !stream_read(s, (uint8_t*)&hdr + have, sizeof(hdr) - have))
+    {
+        goto out;
+    }
+    if(hdr.magic != MH_MAGIC && hdr.magic != MH_MAGIC_64)
+    {
+        LOG("Bad magic: %08llx", (unsigned long long)hdr.magic);
+        goto out;
+    }
+    // The 64bit header just has one more field.
+    size_t hdrlen = (hdr.magic == MH_MAGIC_64 ? sizeof(mach_hdr64_t) : sizeof(mach_hdr32_t)) + hdr.sizeofcmds;
+    if(hdrlen > sl->size)
+    {
+        LOG("File too short for load commands.");
+        goto out;
+    }
+    buf = malloc(hdrlen);
+    if(!buf)
+    {
+        LOG("malloc: %s", strerror(errno));
+        goto out;
+    }
+    memcpy(buf, &hdr, sizeof(hdr));
+    if(!stream_read(s, buf + sizeof(hdr), hdrlen - sizeof(hdr)))
+    {
+        goto out;
+    }
+    ok = extract(opt, buf, (size_t)sl->size, s, outpath);
+out:;
+    if(buf) free(buf);
+    return ok;
+}
+
+// Extracts the Mach-O or fat binary at inpath, "-" being stdin.
+static bool process(const vmacho_opts_t *opt, const char *inpath, const char *outpath)
+{
+    bool ok = false;
+    void *file = NULL;
+    size_t flen = 0;
+    FILE *infile = NULL;
+    slice_t *slices = NULL;
+    uint32_t nslices = 0;
+    bool mapped = false; // file is mmap'ed rather than streamed
+    stream_t stream;
+    const char *prev = log_what,
+               *what = strcmp(inpath, "-") == 0 ? "stdin" : inpath;
+    log_what = what;
+
+    infile = strcmp(inpath, "-") == 0 ? stdin : fopen(inpath, "rb");
+    if(!infile)
+    {
+        LOG("fopen(%s): %s", inpath, strerror(errno));
+        goto out;
+    }
+    stream = (stream_t){ .f = infile, .pos = 0 };
+#ifndef _WIN32
+    // Regular files are mapped instead of read, so that nothing is copied up front.
+    struct stat st;
+    if(infile != stdin && fstat(fileno(infile), &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= (off_t)sizeof(uint32_t))
+    {
+        flen = (size_t)st.st_size;
+        file = mmap(NULL, flen, PROT_READ, MAP_PRIVATE, fileno(infile), 0);
+        if(file == MAP_FAILED)
+        {
+            file = NULL;
+            LOG("mmap: %s", strerror(errno));
+            goto out;
+        }
+        mapped = true;
+    }
+#endif
+    if(!mapped)
+    {
+        // Anything else, pipes included, is read front to back. Only the headers are kept.
+        file = malloc(sizeof(mach_hdr32_t));
+        if(!file)
+        {
+            LOG("malloc(file): %s", strerror(errno));
+            goto out;
+        }
+        if(!stream_read(&stream, file, sizeof(fat_hdr_t)))
+        {
+            goto out;
+        }
+        const fat_hdr_t *fat = file;
+        uint32_t magic = swap32(fat->magic),
+                 n     = swap32(fat->nfat_arch);
+        if(magic == FAT_MAGIC || magic == FAT_MAGIC_64)
+        {
+            if(n > 0x1000)
+            {
+                LOG("Bad fat arch count: %u", n);
+                goto out;
+            }
+            flen = sizeof(fat_hdr_t) + n * (magic == FAT_MAGIC_64 ? sizeof(fat_arch64_t) : sizeof(fat_arch32_t));
+            void *tmp = realloc(file, flen);
+            if(!tmp)
+            {
+                LOG("realloc(file): %s", strerror(errno));
+                goto out;
+            }
+            file = tmp;
+        }
+        else
+        {
+            flen = sizeof(mach_hdr32_t);
+        }
+        if(!stream_read(&stream, (uint8_t*)file + sizeof(fat_hdr_t), flen - sizeof(fat_hdr_t)))
+        {
+            goto out;
+        }
+    }
+
+    if(!get_slices(file, mapped ? flen : LEN_UNKNOWN, &slices, &nslices))
+    {
+        goto out;
+    }
+    for(uint32_t i = 0; i < nslices; ++i)
+    {
+        if(mapped)
+        {
+            slices[i].file = (const uint8_t*)file + slices[i].offset;
+        }
+        slices[i].what = malloc(strlen(what) + strlen(slices[i].name) + sizeof(" ()"));
+        if(!slices[i].what)
+        {
+            LOG("malloc: %s", strerror(errno));
+            goto out;
+        }
+        sprintf(slices[i].what, "%s (%s)", what, slices[i].name);
+    }
+    slice_t *pick = NULL;
+    if(opt->arch)
+    {
+        uint32_t cputype = 0,
+                 cpusubtype = 0;
+        if(!arch_parse(opt->arch, &cputype, &cpusubtype))
+        {
+            LOG("Unknown arch: %s", opt->arch);
+            goto out;
+        }
+        for(uint32_t i = 0; i < nslices; ++i)
+        {
+            if(slices[i].cputype == cputype && (cpusubtype == CPU_SUBTYPE_ANY || (slices[i].cpusubtype & ~CPU_SUBTYPE_MASK) == cpusubtype))
+            {
+                pick = &slices[i];
+                break;
+            }
+        }
+        if(!pick)
+        {
+            LOG("No slice for arch %s", opt->arch);
+            goto out;
+        }
+    }
+    else if(nslices == 1 && !opt->all)
+    {
+        pick = &slices[0];
+    }
+    else if(!opt->all)
+    {
+        LOG("Fat binary with %u slices, pick one with -a or extract all with -A:", nslices);
+        for(uint32_t i = 0; i < nslices; ++i)
+        {
+            LOG("    %s", slices[i].name);
+        }
+        goto out;
+    }
+
+    if(pick)
+    {
+        log_what = pick->what;
+        ok = mapped ? extract(opt, pick->file, (size_t)pick->size, NULL, outpath) : stream_extract(opt, &stream, pick, file, flen, outpath);
+        goto out;
+    }
+
+    // Every slice to its own output, each on its own thread.
+    for(uint32_t i = 0; i < nslices; ++i)
+    {
+        slices[i].opt = opt;
+        slices[i].out = slice_path(outpath, slices[i].name);
+        if(!slices[i].out)
+        {
+            goto out;
+        }
+    }
+    if(!mapped)
+    {
+        // One after another, in the order they come in.
+        qsort(slices, nslices, sizeof(*slices), slice_cmp);
+        for(uint32_t i = 0; i < nslices; ++i)
+        {
+            log_what = slices[i].what;
+            slices[i].ok = stream_extract(opt, &stream, &slices[i], file, flen, slices[i].out);
+        }
+        log_what = what;
+    }
+#ifndef _WIN32
+    for(uint32_t i = 0; mapped && i < nslices; ++i)
+    {
+        int r = pthread_create(&slices[i].thread, NULL, &extract_slice, &slices[i]);
+        if(r != 0)
+        {
+            LOG("pthread_create: %s", strerror(r));
+            // Do this one here instead.
+            extract_slice(&slices[i]);
+        }
+        else
+        {
+            slices[i].joinable = true;
+        }
+    }
+    for(uint32_t i = 0; i < nslices; ++i)
+    {
+        if(slices[i].joinable)
+        {
+            pthread_join(slices[i].thread, NULL);
+        }
+    }
+#else
+    for(uint32_t i = 0; mapped && i < nslices; ++i)
+    {
+        extract_slice(&slices[i]);
+    }
+#endif
+    ok = true;
+    for(uint32_t i = 0; i < nslices; ++i)
+    {
+        if(!slices[i].ok)
+        {
+            LOG("Failed to extract %s", slices[i].name);
+            ok = false;
+        }
+    }
+
+out:;
+    if(slices)
+    {
+        for(uint32_t i = 0; i < nslices; ++i)
+        {
+            if(slices[i].out) free(slices[i].out);
+            if(slices[i].what) free(slices[i].what);
+        }
+        free(slices);
+    }
+#ifndef _WIN32
+    if(mapped) munmap(file, flen);
+    else
+#endif
     if(file) free(file);
     if(infile && infile != stdin) fclose(infile);
+    log_what = prev;
+    return ok;
+}
+
+// An empty dir just copies name.
+static char* path_join(const char *dir, const char *name)
+{
+    size_t len = strlen(dir);
+    char *path = malloc(len + strlen(name) + 2);
+    if(!path)
+    {
+        LOG("malloc: %s", strerror(errno));
+        return NULL;
+    }
+    sprintf(path, !len || dir[len - 1] == '/' || dir[len - 1] == '\\' ? "%s%s" : "%s/%s", dir, name);
+    return path;
+}
+
+// Output for a job that doesn't name one: its input's name in outdir, plus .S for assembler stubs.
+static char* batch_out(const batch_t *b, const char *outdir, const char *name)
+{
+    char *out = path_join(outdir, name);
+    if(out && b->opt->mode == Mode_Incbin)
+    {
+        size_t len = strlen(out);
+        char *s = realloc(out, len + sizeof(".S"));
+        if(!s)
+        {
+            LOG("realloc: %s", strerror(errno));
+            free(out);
+            return NULL;
+        }
+        memcpy(s + len, ".S", sizeof(".S"));
+        out = s;
+    }
+    return out;
+}
+
+// Takes ownership of in and out.
+static bool batch_add(batch_t *b, size_t *cap, char *in, char *out)
+{
+    if(!in || !out)
+    {
+        goto err;
+    }
+    if(b->num >= *cap)
+    {
+        size_t c = *cap ? *cap * 2 : 64;
+        job_t *job = realloc(b->job, c * sizeof(*job));
+        if(!job)
+        {
+            LOG("realloc: %s", strerror(errno));
+            goto err;
+        }
+        b->job = job;
+        *cap = c;
+    }
+    b->job[b->num++] = (job_t){ .in = in, .out = out, .ok = false };
+    return true;
+err:;
+    if(in) free(in);
+    if(out) free(out);
+    return false;
+}
+
+#ifndef _WIN32
+static int job_cmp(const void *a, const void *b)
+{
+    return strcmp(((const job_t*)a)->in, ((const job_t*)b)->in);
+}
+
+// Every regular file in dir, by name, each to outdir under the same name (see batch_out()).
+static bool batch_dir(batch_t *b, size_t *cap, const char *dir, const char *outdir)
+{
+    bool ok = false;
+    DIR *d = opendir(dir);
+    if(!d)
+    {
+        LOG("opendir(%s): %s", dir, strerror(errno));
+        goto out;
+    }
+    for(struct dirent *ent; (ent = readdir(d)) != NULL; )
+    {
+        if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+        char *in = path_join(dir, ent->d_name);
+        struct stat st;
+        if(in && (stat(in, &st) != 0 || !S_ISREG(st.st_mode)))
+        {
+            free(in);
+            continue;
+        }
+        if(!batch_add(b, cap, in, batch_out(b, outdir, ent->d_name)))
+        {
+            goto out;
+        }
+    }
+    qsort(b->job, b->num, sizeof(*b->job), job_cmp);
+    ok = true;
+out:;
+    if(d) closedir(d);
+    return ok;
+}
+#endif
+
+// One "in" or "in<tab>out" per line, relative outputs going into outdir.
+// Without an output, the input's file name is used.
+static bool batch_list(batch_t *b, size_t *cap, const char *list, const char *outdir)
+{
+    bool ok = false;
+    char *buf = NULL;
+    size_t len = 0,
+           max = 0;
+    FILE *f = strcmp(list, "-") == 0 ? stdin : fopen(list, "rb");
+    if(!f)
+    {
+        LOG("fopen(%s): %s", list, strerror(errno));
+        goto out;
+    }
+    while(true)
+    {
+        if(len + 1 >= max)
+        {
+            max = max ? max * 2 : 0x10000;
+            char *tmp = realloc(buf, max);
+            if(!tmp)
+            {
+                LOG("realloc: %s", strerror(errno));
+                goto out;
+            }
+            buf = tmp;
+        }
+        size_t n = fread(buf + len, 1, max - len - 1, f);
+        len += n;
+        if(n == 0)
+        {
+            if(ferror(f))
+            {
+                LOG("fread(%s): %s", list, strerror(errno));
+                goto out;
+            }
+            break;
+        }
+    }
+    buf[len] = '\0';
+
+    for(char *line = buf, *next; line < buf + len; line = next)
+    {
+        char *nl = strchr(line, '\n');
+        next = nl ? nl + 1 : buf + len;
+        if(nl)
+        {
+            *nl = '\0';
+        }
+        size_t l = strlen(line);
+        if(l && line[l - 1] == '\r')
+        {
+            line[--l] = '\0';
+        }
+        if(l == 0 || line[0] == '#')
+        {
+            continue;
+        }
+        char *out = strchr(line, '\t');
+        bool named = out != NULL;
+        if(out)
+        {
+            *out++ = '\0';
+        }
+        else
+        {
+            out = line;
+            for(char *c = line; *c; ++c)
+            {
+                if(*c == '/' || *c == '\\')
+                {
+                    out = c + 1;
+                }
+            }
+        }
+        if(!*line || !*out)
+        {
+            LOG("Bad line in %s: %s", list, line);
+            goto out;
+        }
+        char *in = path_join("", line),
+             *o  = !named ? batch_out(b, outdir, out) : path_join(out[0] == '/' || out[0] == '\\' ? "" : outdir, out);
+        if(!batch_add(b, cap, in, o))
+        {
+            goto out;
+        }
+    }
+    ok = true;
+out:;
+    if(buf) free(buf);
+    if(f && f != stdin) fclose(f);
+    return ok;
+}
+
+static void* batch_worker(void *arg)
+{
+    batch_t *b = arg;
+    while(true)
+    {
+#ifndef _WIN32
+        pthread_mutex_lock(&b->lock);
+#endif
+        size_t i = b->next;
+        if(i < b->num)
+        {
+            ++b->next;
+        }
+#ifndef _WIN32
+        pthread_mutex_unlock(&b->lock);
+#endif
+        if(i >= b->num)
+        {
+            break;
+        }
+        job_t *job = &b->job[i];
+        job->ok = process(b->opt, job->in, job->out);
+        if(!job->ok)
+        {
+            LOG("%s: failed", job->in);
+        }
+    }
+    return NULL;
+}
+
+// Extracts every input of list (a directory, or a file listing them) on a pool of jobs threads.
+// Failures are reported per file and don't stop the others.
+static bool run_batch(const vmacho_opts_t *opt, const char *list, const char *outdir, size_t jobs)
+{
+    bool ok = false;
+    size_t cap = 0,
+           failed = 0;
+    batch_t b = { .opt = opt, .job = NULL, .num = 0, .next = 0 };
+#ifndef _WIN32
+    pthread_t *thr = NULL;
+    size_t nthr = 0;
+    pthread_mutex_init(&b.lock, NULL);
+    struct stat st;
+    if(strcmp(list, "-") != 0 && stat(list, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        if(!batch_dir(&b, &cap, list, outdir))
+        {
+            goto out;
+        }
+    }
+    else
+#endif
+    if(!batch_list(&b, &cap, list, outdir))
+    {
+        goto out;
+    }
+
+#ifndef _WIN32
+    if(jobs == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (size_t)cpus : 1;
+    }
+    // This thread is a worker too.
+    if(jobs > 1 && b.num > 1)
+    {
+        thr = malloc((jobs - 1) * sizeof(*thr));
+        if(!thr)
+        {
+            LOG("malloc: %s", strerror(errno));
+            goto out;
+        }
+        for(; nthr < jobs - 1 && nthr < b.num - 1; ++nthr)
+        {
+            int r = pthread_create(&thr[nthr], NULL, &batch_worker, &b);
+            if(r != 0)
+            {
+                LOG("pthread_create: %s", strerror(r));
+                break;
+            }
+        }
+    }
+#else
+    // No threads here.
+    (void)jobs;
+#endif
+    batch_worker(&b);
+#ifndef _WIN32
+    for(size_t i = 0; i < nthr; ++i)
+    {
+        pthread_join(thr[i], NULL);
+    }
+#endif
+
+    for(size_t i = 0; i < b.num; ++i)
+    {
+        if(!b.job[i].ok)
+        {
+            ++failed;
+        }
+    }
+    if(failed)
+    {
+        LOG("Failed %zu of %zu:", failed, b.num);
+        for(size_t i = 0; i < b.num; ++i)
+        {
+            if(!b.job[i].ok)
+            {
+                LOG("    %s", b.job[i].in);
+            }
+        }
+    }
+    else
+    {
+        LOG("Extracted %zu files", b.num);
+    }
+    ok = failed == 0;
+
+out:;
+#ifndef _WIN32
+    if(thr) free(thr);
+    pthread_mutex_destroy(&b.lock);
+#endif
+    if(b.job)
+    {
+        for(size_t i = 0; i < b.num; ++i)
+        {
+            free(b.job[i].in);
+            free(b.job[i].out);
+        }
+        free(b.job);
+    }
+    return ok;
+}
+
+int main(int argc, const char **argv)
+{
+    int retval = -1;
+    vmacho_opts_t opt =
+    {
+        .mode         = Mode_Binary,
+        .oflags       = "wbx",
+        .aname        = NULL,
+        .use_sections = true,
+        .fmax         = 0,
+        .smax         = 0,
+        .arch         = NULL,
+        .all          = false,
+    };
+    bool batch  = false;
+    size_t jobs = 0;
+    char ename[256];
+
+    int aoff = 1;
+    for(; aoff < argc; ++aoff)
+    {
+        if(argv[aoff][0] != '-' || argv[aoff][1] == '\0')
+        {
+            break;
+        }
+        int curoff = aoff;
+        for(size_t i = 1; argv[curoff][i] != '\0'; ++i)
+        {
+            char c = argv[curoff][i];
+            switch(c)
+            {
+                case 'a':
+                    if(argc - aoff < 4) // Don't want curoff here
+                    {
+                        LOG("-%c requires an argument", c);
+                        goto out;
+                    }
+                    opt.arch = argv[++aoff];
+                    break;
+                case 'A':
+                    opt.all = true;
+                    break;
+                case 'B':
+                    batch = true;
+                    break;
+                case 'c':
+                    opt.mode = Mode_HeadlessArray;
+                    break;
+                case 'C':
+                    if(argc - aoff < 4) // Don't want curoff here
+                    {
+                        LOG("-%c requires an argument", c);
+                        goto out;
+                    }
+                    opt.mode = Mode_NamedArray;
+                    opt.aname = argv[++aoff];
+                    break;
+                case 'e':
+                case 'S':
+                    if(argc - aoff < 4) // Don't want curoff here
+                    {
+                        LOG("-%c requires an argument", c);
+                        goto out;
+                    }
+                    opt.mode = c == 'e' ? Mode_Elf : Mode_Incbin;
+                    opt.aname = argv[++aoff];
+                    if(c == 'e')
+                    {
+                        // name:machine, or the host's machine by default.
+                        const char *colon = strchr(opt.aname, ':'),
+                                   *mach  = colon ? colon + 1 : elf_host();
+                        if(!mach)
+                        {
+                            LOG("No ELF machine known for this host, give one with -e name:machine");
+                            goto out;
+                        }
+                        if(!elf_target(mach, &opt.elf))
+                        {
+                            LOG("Unknown ELF machine: %s", mach);
+                            goto out;
+                        }
+                        if(colon)
+                        {
+                            // Only the name goes into the symbols.
+                            size_t nlen = (size_t)(colon - opt.aname);
+                            if(nlen >= sizeof(ename))
+                            {
+                                LOG("Symbol name too long: %s", opt.aname);
+                                goto out;
+                            }
+                            memcpy(ename, opt.aname, nlen);
+                            ename[nlen] = '\0';
+                            opt.aname = ename;
+                        }
+                    }
+                    break;
+                case 'f':
+                    opt.oflags = "wb";
+                    break;
+                case 'j':
+                case 'm':
+                case 'M':
+                    if(argc - aoff < 4) // Don't want curoff here
+                    {
+                        LOG("-%c requires an argument", c);
+                        goto out;
+                    }
+                    const char *num = argv[++aoff];
+                    char *end = NULL;
+                    unsigned long long l = strtoull(num, &end, 0);
+                    if(*num == '\0' || *end != '\0')
+                    {
+                        LOG("Invalid argument to -%c: %s", c, num);
+                        goto out;
+                    }
+                    if(c == 'j')
+                        jobs = (size_t)l;
+                    else if(c == 'm')
+                        opt.fmax = (size_t)l;
+                    else
+                        opt.smax = (size_t)l;
+                    break;
+                case 's':
+                    opt.use_sections = false;
+                    break;
+                default:
+                    LOG("Bad option: -%c", c);
+                    goto out;
+            }
+        }
+    }
+    if(argc - aoff != 2)
+    {
+        fprintf(stderr, "Usage: %s [-Acfs] [-a arch] [-C name] [-e name[:machine]] [-S name] [-m max] [-M max] in out\n"
+                        "       %s -B [-j jobs] [-Acfs] [-a arch] [-C name] [-e name[:machine]] [-S name] [-m max] [-M max] list outdir\n"
+                        "    -a arch Extract the slice for arch (name or cputype) from a fat binary\n"
+                        "    -A      Extract every slice of a fat binary, each to out with its arch inserted\n"
+                        "    -B      Batch mode: extract every file in a directory, or listed in a file (one \"in\" or \"in<tab>out\" per line)\n"
+                        "            into outdir, and report the ones that failed\n"
+                        "    -c      Output as headless C array\n"
+                        "    -C name Output as named C array\n"
+                        "    -e name[:machine]\n"
+                        "            Output as ELF object defining name and name_size, for machine (aarch64, x86_64, i386, arm,\n"
+                        "            riscv64, riscv32 or an e_machine number), by default the one vmacho runs on\n"
+                        "    -S name Output as assembler stub defining name and name_size, to out ending in .S, with the image in\n"
+                        "            out.bin next to it (pass its directory to the assembler with -I). Batch outputs get .S appended\n"
+                        "    -f      Force (overwrite existing files)\n"
+                        "    -j jobs With -B, extract on this many threads (default one per CPU)\n"
+                        "    -m max  Enforce max size of bytes for total file mapping\n"
+                        "    -M max  Enforce max size of bytes for total runtime size\n"
+                        "    -s      Use only segments for mapping, ignore sections\n"
+                        , argv[0], argv[0]);
+        goto out;
+    }
+    if(strcmp(argv[aoff + 1], "-") == 0 && (batch || opt.all || opt.mode == Mode_Incbin))
+    {
+        LOG("-%c requires an output %s", batch ? 'B' : opt.all ? 'A' : 'S', batch ? "directory" : "file");
+        goto out;
+    }
+
+    retval = (batch ? run_batch(&opt, argv[aoff], argv[aoff + 1], jobs) : process(&opt, argv[aoff], argv[aoff + 1])) ? 0 : -1;
+
+out:;
     return retval;
 }
@@ -1,21 +1,44 @@
-// cc -o xref xref.c -Wall -O3
+// cc -o xref xref.c -Wall -O3 -pthread
+#include <dirent.h>             // opendir, readdir
 #include <errno.h>
 #include <fcntl.h>              // open
+#include <pthread.h>
+#include <signal.h>             // signal, sigaction, SIGPIPE, SIGINT, SIGTERM
 #include <stdbool.h>
 #include <stdlib.h>             // strtoull
 #include <stdint.h>
 #include <stdio.h>              // fprintf, stderr
 #include <string.h>             // strerror
-#include <unistd.h>             // close
+#include <time.h>               // clock_gettime
+#include <unistd.h>             // close, sysconf
 #include <sys/mman.h>           // mmap, munmap, MAP_FAILED, PROT_READ
+#include <sys/resource.h>       // getrusage
+#include <sys/socket.h>         // socket, bind, listen, accept
 #include <sys/stat.h>           // fstat
+#include <sys/un.h>             // sockaddr_un
 
 #define SWAP32(x) (((x & 0xff000000) >> 24) | ((x & 0xff0000) >> 8) | ((x & 0xff00) << 8) | ((x & 0xff) << 24))
 
 #define FAT_CIGAM       0xbebafeca
 #define MH_MAGIC_64     0xfeedfacf
+#define MH_FILESET      0xc
+#define LC_SYMTAB       0x2
 #define LC_SEGMENT_64   0x19
+#define LC_UUID         0x1b
+#define LC_FUNCTION_STARTS 0x26
+#define LC_DYLD_CHAINED_FIXUPS 0x80000034
+#define LC_FILESET_ENTRY       0x80000035
 #define CPU_TYPE_ARM64  0x0100000c
+#define VM_PROT_EXECUTE 0x4
+#define N_STAB          0xe0
+#define N_TYPE          0x0e
+#define N_SECT          0xe
+
+#define SECTION_TYPE                0x000000ff
+#define S_ZEROFILL                  0x1
+#define S_CSTRING_LITERALS          0x2
+#define S_ATTR_PURE_INSTRUCTIONS    0x80000000
+#define S_ATTR_SOME_INSTRUCTIONS    0x00000400
 
 typedef uint32_t vm_prot_t;
 
@@ -67,381 +90,5264 @@ typedef struct
     uint32_t  flags;
 } mach_seg_t;
 
-int main(int argc, const char **argv)
+typedef struct
 {
-    int retval = -1;
-    int fd = -1;
-    void *mem = MAP_FAILED;
-    if(argc != 3)
+    char     sectname[16];
+    char     segname[16];
+    uint64_t addr;
+    uint64_t size;
+    uint32_t offset;
+    uint32_t align;
+    uint32_t reloff;
+    uint32_t nreloc;
+    uint32_t flags;
+    uint32_t reserved1;
+    uint32_t reserved2;
+    uint32_t reserved3;
+} mach_sect_t;
+
+typedef struct
+{
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint8_t  uuid[16];
+} mach_uuid_t;
+
+typedef struct
+{
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint32_t dataoff;
+    uint32_t datasize;
+} mach_data_t;
+
+typedef struct
+{
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint32_t symoff;
+    uint32_t nsyms;
+    uint32_t stroff;
+    uint32_t strsize;
+} mach_symtab_t;
+
+typedef struct
+{
+    uint32_t n_strx;
+    uint8_t  n_type;
+    uint8_t  n_sect;
+    uint16_t n_desc;
+    uint64_t n_value;
+} nlist_t;
+
+typedef struct
+{
+    uint32_t cmd;
+    uint32_t cmdsize;
+    uint64_t vmaddr;
+    uint64_t fileoff;
+    uint32_t entry_id;  // Offset of the name, from the start of the command
+    uint32_t reserved;
+} mach_fileset_t;
+
+typedef struct
+{
+    uint32_t fixups_version;
+    uint32_t starts_offset;
+    uint32_t imports_offset;
+    uint32_t symbols_offset;
+    uint32_t imports_count;
+    uint32_t imports_format;
+    uint32_t symbols_format;
+} fixups_hdr_t;
+
+typedef struct
+{
+    uint32_t seg_count;
+    uint32_t seg_info_offset[];
+} fixups_image_t;
+
+typedef struct
+{
+    uint32_t size;
+    uint16_t page_size;
+    uint16_t pointer_format;
+    uint64_t segment_offset;
+    uint32_t max_valid_pointer;
+    uint16_t page_count;
+    uint16_t page_start[];
+} fixups_seg_t;
+
+typedef struct
+{
+    char     magic[16];
+    uint32_t mappingOffset;
+    uint32_t mappingCount;
+    uint32_t imagesOffset;
+    uint32_t imagesCount;
+    uint64_t dyldBaseAddress;
+    uint64_t codeSignatureOffset;
+    uint64_t codeSignatureSize;
+    uint64_t slideInfoOffset;
+    uint64_t slideInfoSize;
+    uint64_t localSymbolsOffset;
+    uint64_t localSymbolsSize;
+    uint8_t  uuid[16];
+    uint64_t cacheType;
+    uint32_t branchPoolsOffset;
+    uint32_t branchPoolsCount;
+    uint64_t accelerateInfoAddr;
+    uint64_t accelerateInfoSize;
+    uint64_t imagesTextOffset;
+    uint64_t imagesTextCount;
+} cache_hdr_t;
+
+typedef struct
+{
+    uint64_t address;
+    uint64_t size;
+    uint64_t fileOffset;
+    uint32_t maxProt;
+    uint32_t initProt;
+} cache_map_t;
+
+typedef struct
+{
+    uint64_t address;
+    uint64_t modTime;
+    uint64_t inode;
+    uint32_t pathFileOffset;
+    uint32_t pad;
+} cache_img_t;
+
+// Newer caches have imagesOffset and imagesCount here instead, and zero in the old fields.
+#define CACHE_IMAGES_NEW 0x1c0
+
+#define DYLD_CHAINED_PTR_ARM64E                 1
+#define DYLD_CHAINED_PTR_64                     2
+#define DYLD_CHAINED_PTR_64_OFFSET              6
+#define DYLD_CHAINED_PTR_ARM64E_KERNEL          7
+#define DYLD_CHAINED_PTR_64_KERNEL_CACHE        8
+#define DYLD_CHAINED_PTR_ARM64E_USERLAND        9
+#define DYLD_CHAINED_PTR_ARM64E_FIRMWARE        10
+#define DYLD_CHAINED_PTR_ARM64E_USERLAND24      12
+#define DYLD_CHAINED_PTR_START_NONE             0xffff
+#define DYLD_CHAINED_PTR_START_MULTI            0x8000
+
+// Targets are half-open ranges, single addresses are ranges of length one.
+typedef struct
+{
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t reach;     // Highest hi of this and all preceding spans, to find overlapping ones
+    uint64_t sub;       // Highest hi in this span's subtree, see targets_tree()
+} span_t;
+
+typedef struct
+{
+    span_t *span;       // Sorted by lo
+    size_t num;
+    size_t cap;
+    bool multi;
+} targets_t;
+
+// Makes room for one more element in a dynamic array.
+static bool grow(void *arr, size_t *cap, size_t num, size_t size)
+{
+    if(num < *cap)
     {
-        fprintf(stderr, "Usage: %s file addr\n", argv[0]);
-        goto out;
+        return true;
     }
-
-    char *str = NULL;
-    const unsigned long long search = strtoull(argv[2], &str, 16);
-    if(argv[2][0] == '\0' || str[0] != '\0')
+    size_t newcap = *cap ? *cap * 2 : 0x100;
+    void *mem = realloc(*(void**)arr, newcap * size);
+    if(!mem)
     {
-        fprintf(stderr, "Bad address.\n");
-        goto out;
+        fprintf(stderr, "realloc: %s\n", strerror(errno));
+        return false;
     }
+    *(void**)arr = mem;
+    *cap = newcap;
+    return true;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    fd = open(argv[1], O_RDONLY);
-    if(fd == -1)
+static bool targets_add(targets_t *t, uint64_t lo, uint64_t hi)
+{
+    if(!grow(&t->span, &t->cap, t->num, sizeof(*t->span)))
     {
-        fprintf(stderr, "open: %s\n", strerror(errno));
-        goto out;
+        return false;
     }
+    t->span[t->num++] = (span_t){ .lo = lo, .hi = hi };
+    return true;
+}
 
-    struct stat s;
-    if(fstat(fd, &s) != 0)
+static bool parse_addr(const char *str, uint64_t *addr)
+{
+    char *end = NULL;
+    unsigned long long val = strtoull(str, &end, 16);
+    if(str[0] == '\0' || end[0] != '\0')
     {
-        fprintf(stderr, "fstat: %s\n", strerror(errno));
-        goto out;
+        return false;
     }
+    *addr = val;
+    return true;
+}
 
-    if(sizeof(mach_hdr_t) > s.st_size)
+// Either a single address, lo-hi (hi exclusive) or lo+len, all in hex.
+static bool parse_target(const char *str, uint64_t *lo, uint64_t *hi)
+{
+    char buf[64];
+    size_t len = strcspn(str + 1, "-+") + 1;
+    if(str[0] == '\0' || str[len] == '\0')
     {
-        fprintf(stderr, "File too short to contain Mach-O header.\n");
-        goto out;
+        if(!parse_addr(str, lo) || *lo == UINT64_MAX)
+        {
+            return false;
+        }
+        *hi = *lo + 1;
+        return true;
     }
+    if(len >= sizeof(buf))
+    {
+        return false;
+    }
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+    uint64_t val;
+    if(!parse_addr(buf, lo) || !parse_addr(str + len + 1, &val))
+    {
+        return false;
+    }
+    *hi = str[len] == '+' ? *lo + val : val;
+    return *hi > *lo;
+}
 
-    mem = mmap(NULL, s.st_size, PROT_READ, MAP_FILE | MAP_PRIVATE, fd, 0);
-    if(mem == MAP_FAILED)
+// One target per line, as for parse_target(), "#" starts a comment.
+static bool targets_read(targets_t *t, const char *path)
+{
+    bool ok = false;
+    char *line = NULL;
+    size_t len = 0;
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if(!f)
     {
-        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        fprintf(stderr, "fopen(%s): %s\n", path, strerror(errno));
         goto out;
     }
-    uint64_t filesize = s.st_size;
-
-    mach_hdr_t *hdr = mem;
-    fat_hdr_t *fat = mem;
-    if(fat->magic == FAT_CIGAM)
+    for(size_t n = 1; getline(&line, &len, f) != -1; ++n)
     {
-        if(sizeof(fat_arch_t) * SWAP32(fat->nfat_arch) > filesize - sizeof(mach_hdr_t))
+        line[strcspn(line, "#")] = '\0';
+        char *str = line + strspn(line, " \t\r\n");
+        str[strcspn(str, " \t\r\n")] = '\0';
+        if(str[0] == '\0')
         {
-            fprintf(stderr, "File too short to contain fat header.\n");
-            goto out;
+            continue;
         }
-        bool found = false;
-        fat_arch_t *arch = (fat_arch_t*)(fat + 1);
-        for(size_t i = 0; i < SWAP32(fat->nfat_arch); ++i)
+        uint64_t lo, hi;
+        if(!parse_target(str, &lo, &hi))
         {
-            if(SWAP32(arch[i].cputype) == CPU_TYPE_ARM64)
-            {
-                uint32_t offset = SWAP32(arch[i].offset);
-                uint32_t newsize = SWAP32(arch[i].size);
-                if(offset > filesize || newsize > filesize - offset)
-                {
-                    fprintf(stderr, "Fat arch out of bounds.\n");
-                    goto out;
-                }
-                if(newsize < sizeof(mach_hdr_t))
-                {
-                    fprintf(stderr, "Fat arch is too short to contain a Mach-O.\n");
-                    goto out;
-                }
-                hdr = (mach_hdr_t*)((uintptr_t)hdr + offset);
-                filesize = newsize;
-                found = true;
-                break;
-            }
+            fprintf(stderr, "%s:%zu: Bad target: %s\n", path, n, str);
+            goto out;
         }
-        if(!found)
+        if(!targets_add(t, lo, hi))
         {
-            fprintf(stderr, "No arm64 slice in fat binary.\n");
             goto out;
         }
     }
-
-    if(hdr->magic != MH_MAGIC_64)
+    if(ferror(f))
     {
-        fprintf(stderr, "Not a 64-bit Mach-O.\n");
+        fprintf(stderr, "getline(%s): %s\n", path, strerror(errno));
         goto out;
     }
-    if(hdr->cputype != CPU_TYPE_ARM64)
+    ok = true;
+out:;
+    if(line) free(line);
+    if(f && f != stdin) fclose(f);
+    return ok;
+}
+
+static int targets_cmp(const void *a, const void *b)
+{
+    const span_t *x = a,
+                 *y = b;
+    if(x->lo != y->lo) return x->lo < y->lo ? -1 : 1;
+    return x->hi < y->hi ? -1 : x->hi > y->hi ? 1 : 0;
+}
+
+// The sorted spans double as an implicit search tree: the middle of [l, r) is the root, with the
+// halves on either side as its subtrees. Each root records the highest hi below it, so that
+// subtrees that end before an address can be skipped as a whole.
+static uint64_t targets_tree(span_t *span, size_t l, size_t r)
+{
+    if(l >= r)
     {
-        fprintf(stderr, "Not an arm64 binary.\n");
-        goto out;
+        return 0;
     }
-    if(hdr->sizeofcmds > filesize - sizeof(*hdr))
+    size_t m = l + (r - l) / 2;
+    uint64_t a = targets_tree(span, l, m),
+             b = targets_tree(span, m + 1, r),
+             x = span[m].hi;
+    x = a > x ? a : x;
+    span[m].sub = b > x ? b : x;
+    return span[m].sub;
+}
+
+static void targets_sort(targets_t *t)
+{
+    qsort(t->span, t->num, sizeof(*t->span), targets_cmp);
+    size_t n = 0;
+    for(size_t i = 0; i < t->num; ++i)
     {
-        fprintf(stderr, "File too small for Mach-O load commands.\n");
-        goto out;
+        if(n == 0 || t->span[n - 1].lo != t->span[i].lo || t->span[n - 1].hi != t->span[i].hi)
+        {
+            t->span[n] = t->span[i];
+            t->span[n].reach = n == 0 || t->span[n - 1].reach < t->span[n].hi ? t->span[n].hi : t->span[n - 1].reach;
+            ++n;
+        }
     }
+    t->num = n;
+    t->multi = n > 1;
+    targets_tree(t->span, 0, n);
+}
 
-    for(mach_lc_t *lc = (mach_lc_t*)(hdr + 1), *end = (mach_lc_t*)((uintptr_t)lc + hdr->sizeofcmds); lc < end; lc = (mach_lc_t*)((uintptr_t)lc + lc->cmdsize))
+// Number of spans starting at or below addr.
+static size_t targets_upper(const targets_t *t, uint64_t addr)
+{
+    size_t lo = 0,
+           hi = t->num;
+    while(lo < hi)
     {
-        size_t space = (uintptr_t)end - (uintptr_t)lc;
-        if(sizeof(*lc) > space || lc->cmdsize > space)
+        size_t mid = lo + (hi - lo) / 2;
+        if(t->span[mid].lo <= addr)
         {
-            fprintf(stderr, "File too small for Mach-O load command.\n");
-            goto out;
+            lo = mid + 1;
         }
-        if(lc->cmd == LC_SEGMENT_64)
+        else
         {
-            mach_seg_t *seg = (mach_seg_t*)lc;
-            if(seg->fileoff > filesize || seg->filesize > filesize - seg->fileoff)
-            {
-                fprintf(stderr, "Mach-O segment out of bounds.\n");
-                goto out;
-            }
-            uint64_t addr = seg->vmaddr;
-            for(uint32_t *p = (uint32_t*)((uint8_t*)hdr + seg->fileoff), *e = p + (seg->filesize / 4); p < e; ++p, addr += 4)
-            {
-                uint32_t v = *p;
-                if((v & 0x1f000000) == 0x10000000) // adr and adrp
-                {
-                    uint32_t reg = v & 0x1f;
-                    bool is_adrp = (v & 0x80000000) != 0;
-                    int64_t base = is_adrp ? (addr & 0xfffffffffffff000) : addr;
-                    int64_t off  = (int64_t)((uint64_t)((((v >> 5) & 0x7ffff) << 2) | ((v >> 29) & 0x3)) << 43) >> (is_adrp ? 31 : 43);
-                    uint64_t target = base + off;
-                    if(target == search)
-                    {
-                        printf("%#llx: %s x%u, %#llx\n", addr, is_adrp ? "adrp" : "adr", reg, target);
-                    }
-                    // More complicated cases - up to 3 instr
-                    else
-                    {
-                        uint32_t *q = p + 1;
-                        while(q < e && *q == 0xd503201f) // nop
-                        {
-                            ++q;
-                        }
-                        if(q < e)
-                        {
-                            v = *q;
-                            uint32_t reg2 = reg;
-                            uint32_t aoff = 0;
-                            bool found = false;
-                            if((v & 0xff8003e0) == (0x91000000 | (reg << 5))) // 64bit add, match reg
-                            {
-                                reg2 = v & 0x1f;
-                                aoff = (v >> 10) & 0xfff;
-                                if(v & 0x400000) aoff <<= 12;
-                                if(target + aoff == search)
-                                {
-                                    printf("%#llx: %s x%u, %#llx; add x%u, x%u, %#x\n", addr, is_adrp ? "adrp" : "adr", reg, target, reg2, reg, aoff);
-                                    found = true;
-                                }
-                                else
-                                {
-                                    do
-                                    {
-                                        ++q;
-                                    } while(q < e && *q == 0xd503201f); // nop
-                                }
-                            }
-                            if(!found && q < e)
-                            {
-                                v = *q;
-                                if((v & 0xff8003e0) == (0x91000000 | (reg2 << 5))) // 64bit add, match reg
-                                {
-                                    uint32_t xoff = (v >> 10) & 0xfff;
-                                    if(v & 0x400000) xoff <<= 12;
-                                    if(target + aoff + xoff == search)
-                                    {
-                                        // If we get here, we know the previous add matched
-                                        printf("%#llx: %s x%u, %#llx; add x%u, x%u, %#x; add x%u, x%u, %#x\n", addr, is_adrp ? "adrp" : "adr", reg, target, reg2, reg, aoff, v & 0x1f, reg2, xoff);
-                                    }
-                                }
-                                else if((v & 0x3e0003e0) == (0x38000000 | (reg2 << 5))) // all of str[hb]/ldr[hb], match reg
-                                {
-                                    const char *inst = NULL;
-                                    uint8_t size;
-                                    size = (v >> 30) & 0x3;
-                                    uint8_t opc = (v >> 22) & 0x3;
-                                    switch((opc << 4) | size)
-                                    {
-                                        case 0x00:            inst = "strb";  break;
-                                        case 0x01:            inst = "strh";  break;
-                                        case 0x02: case 0x03: inst = "str";   break;
-                                        case 0x10:            inst = "ldrb";  break;
-                                        case 0x11:            inst = "ldrh";  break;
-                                        case 0x12: case 0x13: inst = "ldr";   break;
-                                        case 0x20: case 0x30: inst = "ldrsb"; break;
-                                        case 0x21: case 0x31: inst = "ldrsh"; break;
-                                        case 0x22:            inst = "ldrsw"; break;
-                                    }
-                                    if(inst)
-                                    {
-                                        uint8_t regsize = opc == 2 && size < 2 ? 3 : size;
-                                        const char *rs = regsize == 3 ? "x" : "w";
-                                        if((v & 0x1000000) != 0) // unsigned offset
-                                        {
-                                            uint64_t uoff = ((v >> 10) & 0xfff) << size;
-                                            if(target + aoff + uoff == search)
-                                            {
-                                                if(aoff) // Have add
-                                                {
-                                                    printf("%#llx: %s x%u, %#llx; add x%u, x%u, %#x; %s %s%u, [x%u, %#llx]\n", addr, is_adrp ? "adrp" : "adr", reg, target, reg2, reg, aoff, inst, rs, v & 0x1f, reg2, uoff);
-                                                }
-                                                else // Have no add
-                                                {
-                                                    printf("%#llx: %s x%u, %#llx; %s %s%u, [x%u, %#llx]\n", addr, is_adrp ? "adrp" : "adr", reg, target, inst, rs, v & 0x1f, reg2, uoff);
-                                                }
-                                            }
-                                        }
-                                        else if((v & 0x00200000) == 0)
-                                        {
-                                            int64_t soff = (int64_t)((uint64_t)((v >> 12) & 0x1ff) << 55) >> 55;
-                                            const char *sign = soff < 0 ? "-" : "";
-                                            if(target + aoff + soff == search)
-                                            {
-                                                if((v & 0x400) == 0)
-                                                {
-                                                    if((v & 0x800) == 0) // unscaled
-                                                    {
-                                                        switch((opc << 4) | size)
-                                                        {
-                                                            case 0x00:            inst = "sturb";  break;
-                                                            case 0x01:            inst = "sturh";  break;
-                                                            case 0x02: case 0x03: inst = "stur";   break;
-                                                            case 0x10:            inst = "ldurb";  break;
-                                                            case 0x11:            inst = "ldurh";  break;
-                                                            case 0x12: case 0x13: inst = "ldur";   break;
-                                                            case 0x20: case 0x30: inst = "ldursb"; break;
-                                                            case 0x21: case 0x31: inst = "ldursh"; break;
-                                                            case 0x22:            inst = "ldursw"; break;
-                                                        }
-                                                    }
-                                                    else // unprivileged
-                                                    {
-                                                        switch((opc << 4) | size)
-                                                        {
-                                                            case 0x00:            inst = "sttrb";  break;
-                                                            case 0x01:            inst = "sttrh";  break;
-                                                            case 0x02: case 0x03: inst = "sttr";   break;
-                                                            case 0x10:            inst = "ldtrb";  break;
-                                                            case 0x11:            inst = "ldtrh";  break;
-                                                            case 0x12: case 0x13: inst = "ldtr";   break;
-                                                            case 0x20: case 0x30: inst = "ldtrsb"; break;
-                                                            case 0x21: case 0x31: inst = "ldtrsh"; break;
-                                                            case 0x22:            inst = "ldtrsw"; break;
-                                                        }
-                                                    }
-                                                    if(aoff) // Have add
-                                                    {
-                                                        printf("%#llx: %s x%u, %#llx; add x%u, x%u, %#x; %s %s%u, [x%u, %s%#llx]\n", addr, is_adrp ? "adrp" : "adr", reg, target, reg2, reg, aoff, inst, rs, v & 0x1f, reg2, sign, soff);
-                                                    }
-                                                    else // Have no add
-                                                    {
-                                                        printf("%#llx: %s x%u, %#llx; %s %s%u, [x%u, %s%#llx]\n", addr, is_adrp ? "adrp" : "adr", reg, target, inst, rs, v & 0x1f, reg2, sign, soff);
-                                                    }
-                                                }
-                                                else // pre/post-index
-                                                {
-                                                    if((v & 0x800) != 0) // pre
-                                                    {
-                                                        if(aoff) // Have add
-                                                        {
-                                                            printf("%#llx: %s x%u, %#llx; add x%u, x%u, %#x; %s %s%u, [x%u, %s%#llx]!\n", addr, is_adrp ? "adrp" : "adr", reg, target, reg2, reg, aoff, inst, rs, v & 0x1f, reg2, sign, soff);
-                                                        }
-                                                        else // Have no add
-                                                        {
-                                                            printf("%#llx: %s x%u, %#llx; %s %s%u, [x%u, %s%#llx]!\n", addr, is_adrp ? "adrp" : "adr", reg, target, inst, rs, v & 0x1f, reg2, sign, soff);
-                                                        }
-                                                    }
-                                                    else // post
-                                                    {
-                                                        if(aoff) // Have add
-                                                        {
-                                                            printf("%#llx: %s x%u, %#llx; add x%u, x%u, %#x; %s %s%u, [x%u], %s%#llx\n", addr, is_adrp ? "adrp" : "adr", reg, target, reg2, reg, aoff, inst, rs, v & 0x1f, reg2, sign, soff);
-                                                        }
-                                                        else // Have no add
-                                                        {
-                                                            printf("%#llx: %s x%u, %#llx; %s %s%u, [x%u], %s%#llx\n", addr, is_adrp ? "adrp" : "adr", reg, target, inst, rs, v & 0x1f, reg2, sign, soff);
-                                                        }
-                                                    }
-                                                }
-                                            }
-                                        }
-                                    }
-                                }
-                                // TODO: pairs, SIMD ldr/str, atomics
-                            }
-                        }
-                    }
-                }
-                else if((v & 0xbf000000) == 0x18000000 || (v & 0xff000000) == 0x98000000) // ldr and ldrsw literal
-                {
-                    int64_t off = (int64_t)((uint64_t)((v >> 5) & 0x7ffff) << 45) >> 43;
-                    if(addr + off == search)
-                    {
-                        uint32_t reg  = v & 0x1f;
-                        bool is_ldrsw = (v & 0xff000000) == 0x98000000;
-                        bool is_64bit = (v & 0x40000000) != 0 && !is_ldrsw;
-                        printf("%#llx: %s %s%u, %#llx\n", addr, is_ldrsw ? "ldrsw" : "ldr", is_64bit ? "x" : "w", reg, search);
-                    }
-                }
-                else if((v & 0x7c000000) == 0x14000000) // b and bl
-                {
-                    int64_t off = (int64_t)((uint64_t)(v & 0x3ffffff) << 38) >> 36;
-                    if(addr + off == search)
-                    {
-                        bool is_bl = (v & 0x80000000) != 0;
-                        printf("%#llx: %s %#llx\n", addr, is_bl ? "bl" : "b", search);
-                    }
-                }
-                else if((v & 0xff000010) == 0x54000000) // b.cond
-                {
-                    int64_t off = (int64_t)((uint64_t)((v >> 5) & 0x7ffff) << 45) >> 43;
-                    if(addr + off == search)
-                    {
-                        const char *cond;
-                        switch(v & 0xf)
-                        {
-                            case 0x0: cond = "eq"; break;
-                            case 0x1: cond = "ne"; break;
-                            case 0x2: cond = "hs"; break;
-                            case 0x3: cond = "lo"; break;
-                            case 0x4: cond = "mi"; break;
-                            case 0x5: cond = "pl"; break;
-                            case 0x6: cond = "vs"; break;
-                            case 0x7: cond = "vc"; break;
-                            case 0x8: cond = "hi"; break;
-                            case 0x9: cond = "ls"; break;
-                            case 0xa: cond = "ge"; break;
-                            case 0xb: cond = "lt"; break;
-                            case 0xc: cond = "gt"; break;
-                            case 0xd: cond = "le"; break;
-                            case 0xe: cond = "al"; break;
-                            case 0xf: cond = "nv"; break;
-                        }
-                        printf("%#llx: b.%s %#llx\n", addr, cond, search);
-                    }
-                }
-                else if((v & 0x7e000000) == 0x34000000) // cbz and cbnz
-                {
-                    int64_t off = (int64_t)((uint64_t)((v >> 5) & 0x7ffff) << 45) >> 43;
-                    if(addr + off == search)
-                    {
-                        uint32_t reg  = v & 0x1f;
-                        bool is_64bit = (v & 0x80000000) != 0;
-                        bool is_nz    = (v & 0x01000000) != 0;
-                        printf("%#llx: %s %s%u, %#llx\n", addr, is_nz ? "cbnz" : "cbz", is_64bit ? "x" : "w", reg, search);
-                    }
-                }
-                else if((v & 0x7e000000) == 0x36000000) // tbz and tbnz
-                {
-                    int64_t off = (int64_t)((uint64_t)((v >> 5) & 0x3fff) << 50) >> 48;
-                    if(addr + off == search)
-                    {
-                        uint32_t reg  = v & 0x1f;
-                        uint32_t bit  = ((v >> 19) & 0x1f) | ((v >> 26) & 0x20);
-                        bool is_64bit = bit > 31;
-                        bool is_nz    = (v & 0x01000000) != 0;
-                        printf("%#llx: %s %s%u, %u, %#llx\n", addr, is_nz ? "tbnz" : "tbz", is_64bit ? "x" : "w", reg, bit, search);
-                    }
-                }
-            }
+            hi = mid;
         }
     }
+    return lo;
+}
 
-    retval = 0;
-out:;
-    if(mem != MAP_FAILED) munmap(mem, s.st_size);
-    if(fd != -1) close(fd);
+// Whether any span contains addr.
+static bool targets_hit(const targets_t *t, uint64_t addr)
+{
+    size_t i = targets_upper(t, addr);
+    return i > 0 && t->span[i - 1].reach > addr;
+}
+
+// Index of the first span in [l, r) at or after from that contains addr, or SIZE_MAX.
+static size_t targets_search(const targets_t *t, uint64_t addr, size_t from, size_t l, size_t r)
+{
+    if(l >= r || r <= from)
+    {
+        return SIZE_MAX;
+    }
+    size_t m = l + (r - l) / 2;
+    if(t->span[m].sub <= addr)
+    {
+        return SIZE_MAX;
+    }
+    size_t i = targets_search(t, addr, from, l, m);
+    if(i != SIZE_MAX || t->span[m].lo > addr)
+    {
+        return i;
+    }
+    if(m >= from && t->span[m].hi > addr)
+    {
+        return m;
+    }
+    return targets_search(t, addr, from, m + 1, r);
+}
+
+// The spans containing addr, in order: pass NULL to get the first one, then the previous one.
+static const span_t* targets_next(const targets_t *t, uint64_t addr, const span_t *prev)
+{
+    size_t i = targets_search(t, addr, prev ? (size_t)(prev - t->span) + 1 : 0, 0, t->num);
+    return i != SIZE_MAX ? &t->span[i] : NULL;
+}
+
+typedef enum
+{
+    Ref_Adr,
+    Ref_Adrp,
+    Ref_Add,    // adr/adrp + add
+    Ref_AddAdd, // adr/adrp + add + add
+    Ref_Mem,    // adr/adrp [+ add] + ldr/str
+    Ref_LdrLit,
+    Ref_B,
+    Ref_Bl,
+    Ref_BCond,
+    Ref_Cbz,
+    Ref_Tbz,
+    Ref_Ptr,    // Pointer in a data section
+} ref_kind_t;
+
+typedef struct
+{
+    uint64_t target;
+    uint64_t source;
+    uint32_t kind;
+} ref_t;
+
+typedef struct
+{
+    ref_t *ref;
+    size_t num;
+    size_t cap;
+} refs_t;
+
+typedef struct
+{
+    uint32_t *p;
+    uint32_t *e;
+    uint64_t addr;
+    const char *seg;    // Name of the segment it's in, up to 16 chars
+} range_t;
+
+typedef struct
+{
+    range_t *r;
+    size_t num;
+    size_t cap;
+} ranges_t;
+
+typedef struct
+{
+    const uint8_t *p;
+    uint64_t size;
+    uint64_t addr;
+} data_t;
+
+typedef struct
+{
+    data_t *d;
+    size_t num;
+    size_t cap;
+} datas_t;
+
+// Address ranges of fileset entries or shared cache images, to tag hits with the one they're in.
+typedef struct
+{
+    uint64_t lo;
+    uint64_t hi;
+    const char *name;
+} owner_t;
+
+typedef struct
+{
+    owner_t *o;         // Sorted by lo, non-overlapping
+    size_t num;
+    size_t cap;
+} owners_t;
+
+// Function starts and symbols, to say which function each hit is in.
+typedef struct
+{
+    uint64_t addr;
+    uint64_t end;       // Exclusive: the next function's start, or the end of the code it's in
+    const char *name;   // NULL if there's no symbol here
+} func_t;
+
+typedef struct
+{
+    func_t *f;          // Sorted by addr, unique
+    size_t num;
+    size_t cap;
+} funcs_t;
+
+// Strings found by -s, to say which one each hit loads.
+typedef struct
+{
+    uint64_t lo;
+    uint64_t hi;        // Exclusive, without the terminator
+    const char *p;
+} str_t;
+
+typedef struct
+{
+    str_t *s;           // Sorted by lo, unique
+    size_t num;
+    size_t cap;
+} strs_t;
+
+typedef struct
+{
+    uint8_t *file;      // File offsets are relative to this
+    uint64_t filesize;
+    mach_hdr_t *hdr;
+    mach_seg_t **seg;   // All segments, in load command order
+    size_t nseg;
+    uint64_t base;      // vmaddr of the segment mapping the header
+    const mach_data_t *fixups;
+    const mach_data_t *fstarts;
+    const mach_symtab_t *symtab;
+    const owners_t *own; // Selected entries or images if this is a fileset or shared cache, otherwise NULL
+    const cache_map_t *map; // If set, this is (part of) a shared cache and addresses map to the file through these
+    uint32_t nmap;
+    uint8_t uuid[16];
+} image_t;
+
+// A mapped file, with everything that gets scanned in it.
+typedef struct
+{
+    const char *path;
+    void *mem;
+    uint64_t size;      // Of the whole file
+    image_t img;
+    ranges_t code;
+    datas_t data;       // Only if pointers are wanted
+    datas_t strs;       // Only if strings are searched for
+    owners_t own;
+    funcs_t fn;
+} input_t;
+
+// A decoded reference: the instructions that make it up, in order. The first one is at source,
+// the others are given as byte offsets from there. reg is each instruction's first register operand,
+// or 0xff for those that have none. Pointers in data have no instructions.
+#define HIT_INSNS 5
+
+typedef struct
+{
+    uint64_t source;
+    uint64_t target;
+    uint32_t insn[HIT_INSNS];
+    uint32_t off[HIT_INSNS];
+    uint8_t  reg[HIT_INSNS];
+    uint8_t  kind;
+    uint8_t  len;
+    uint8_t  reserved;
+} hit_t;
+
+typedef struct
+{
+    hit_t *hit;
+    size_t num;
+    size_t cap;
+} hits_t;
+
+typedef struct
+{
+    const targets_t *tg;
+    refs_t *refs;       // If set, record every reference instead of matching against tg
+    hits_t *hits;
+    uint64_t words;     // Instructions run through the prefilter
+    uint64_t cands;     // Of those, the ones it passed on to the tracker
+    bool fail;
+} scan_t;
+
+// On-disk index, followed by uint64_t target[num], uint64_t source[num] and uint8_t kind[num], sorted by target,
+// then idx_page_t page[npage] sorted by address, after padding kind to a multiple of 8 bytes.
+#define IDX_MAGIC   "xrefidx"
+#define IDX_VERSION 2
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint8_t  uuid[16];
+    uint64_t filesize;
+    uint64_t num;
+    uint64_t npage;
+} idx_hdr_t;
+
+// Code is hashed in pieces that don't cross IDX_PAGE boundaries, so that the index of a later
+// build can be made by scanning only the pieces that changed. See index_update().
+#define IDX_PAGE      0x4000
+#define IDX_PAGE_LAST 0x1   // Last piece of its range
+
+typedef struct
+{
+    uint64_t addr;
+    uint32_t size;
+    uint32_t flags;
+    uint64_t hash;
+} idx_page_t;
+
+// On-disk reference graph in CSR form, followed by uint64_t source[nsrc], uint64_t off[nsrc + 1],
+// uint64_t target[nedge] and uint8_t kind[nedge]. Sources are sorted and unique, the edges of source[i]
+// are target[off[i]] up to target[off[i + 1]], sorted by target.
+#define GRAPH_MAGIC   "xrefcsr"
+#define GRAPH_VERSION 1
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint8_t  uuid[16];
+    uint64_t filesize;
+    uint64_t nsrc;
+    uint64_t nedge;
+} graph_hdr_t;
+
+// Binary output: this header, followed by hit_t records until the end of the stream.
+#define HIT_MAGIC   "xrefhit"
+#define HIT_VERSION 1
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t size;      // sizeof(hit_t)
+} hit_hdr_t;
+
+static bool refs_add(refs_t *r, uint64_t source, uint64_t target, ref_kind_t kind)
+{
+    if(!grow(&r->ref, &r->cap, r->num, sizeof(*r->ref)))
+    {
+        return false;
+    }
+    r->ref[r->num++] = (ref_t){ .target = target, .source = source, .kind = kind };
+    return true;
+}
+
+static int refs_cmp(const void *a, const void *b)
+{
+    const ref_t *x = a,
+                *y = b;
+    if(x->target != y->target) return x->target < y->target ? -1 : 1;
+    if(x->source != y->source) return x->source < y->source ? -1 : 1;
+    return x->kind < y->kind ? -1 : x->kind > y->kind ? 1 : 0;
+}
+
+static int edges_cmp(const void *a, const void *b)
+{
+    const ref_t *x = a,
+                *y = b;
+    if(x->source != y->source) return x->source < y->source ? -1 : 1;
+    if(x->target != y->target) return x->target < y->target ? -1 : 1;
+    return x->kind < y->kind ? -1 : x->kind > y->kind ? 1 : 0;
+}
+
+static size_t lower_bound(const uint64_t *arr, size_t num, uint64_t val)
+{
+    size_t lo = 0,
+           hi = num;
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(arr[mid] < val)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Number of entries starting at or below addr.
+static size_t owners_upper(const owners_t *own, uint64_t addr)
+{
+    size_t lo = 0,
+           hi = own->num;
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(own->o[mid].lo <= addr)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static const owner_t* owners_find(const owners_t *own, uint64_t addr)
+{
+    size_t i = owners_upper(own, addr);
+    return i > 0 && addr < own->o[i - 1].hi ? &own->o[i - 1] : NULL;
+}
+
+static bool owners_overlap(const owners_t *own, uint64_t addr, uint64_t size)
+{
+    size_t i = owners_upper(own, addr);
+    return (i > 0 && addr < own->o[i - 1].hi) || (i < own->num && own->o[i].lo - addr < size);
+}
+
+// The function containing addr, if any.
+static const func_t* funcs_find(const funcs_t *fn, uint64_t addr)
+{
+    size_t lo = 0,
+           hi = fn->num;
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(fn->f[mid].addr <= addr)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo > 0 && addr < fn->f[lo - 1].end ? &fn->f[lo - 1] : NULL;
+}
+
+static const str_t* strs_find(const strs_t *str, uint64_t addr)
+{
+    size_t lo = 0,
+           hi = str->num;
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(str->s[mid].lo <= addr)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo > 0 && addr < str->s[lo - 1].hi ? &str->s[lo - 1] : NULL;
+}
+
+// Returns whether target falls into one of the targets.
+// When building an index, every reference is recorded and nothing matches.
+static bool match(scan_t *sc, uint64_t source, uint64_t target, ref_kind_t kind)
+{
+    if(sc->refs)
+    {
+        if(!refs_add(sc->refs, source, target, kind))
+        {
+            sc->fail = true;
+        }
+        return false;
+    }
+    return targets_hit(sc->tg, target);
+}
+
+// Adds an empty hit, to be filled in with hit_insn().
+static hit_t* hits_add(scan_t *sc, uint64_t source, uint64_t target, ref_kind_t kind)
+{
+    hits_t *h = sc->hits;
+    if(!grow(&h->hit, &h->cap, h->num, sizeof(*h->hit)))
+    {
+        sc->fail = true;
+        return NULL;
+    }
+    hit_t *hit = &h->hit[h->num++];
+    memset(hit, 0, sizeof(*hit));
+    hit->source = source;
+    hit->target = target;
+    hit->kind   = kind;
+    return hit;
+}
+
+static void hit_insn(hit_t *hit, uint32_t v, uint32_t off)
+{
+    bool noreg = (v & 0x7c000000) == 0x14000000 || (v & 0xff000010) == 0x54000000; // b, bl and b.cond
+    hit->insn[hit->len] = v;
+    hit->off[hit->len]  = off;
+    hit->reg[hit->len]  = noreg ? 0xff : v & 0x1f;
+    ++hit->len;
+}
+
+// Dataflow tracker: per-register state for values derived from an adr/adrp, carried through
+// adds, movs and unrelated instructions until the register is overwritten or the basic block ends.
+// Each chain remembers the instructions that built it, so that hits can be printed in full.
+#define CHAIN_LEN (HIT_INSNS - 1)
+
+// How far a chain may get from an adr/adrp result: two adds of up to 0xfff << 12 each,
+// plus the largest scaled load/store offset (q registers), or the most negative ldraa offset.
+#define CHAIN_MIN (-0x1000LL)
+#define CHAIN_MAX (2 * 0xfff000LL + 0xfff0LL)
+
+typedef struct
+{
+    uint64_t src;               // Address of the adr/adrp
+    uint64_t val;               // Current value of the register
+    uint32_t insn[CHAIN_LEN];   // adr/adrp, then up to two adds and any movs
+    uint32_t off[CHAIN_LEN];    // Byte offsets of insn from src
+    uint8_t  len;
+    uint8_t  adds;
+} track_t;
+
+typedef struct
+{
+    track_t reg[31];
+    uint32_t live;              // Bitmask of registers currently tracked
+} tracker_t;
+
+typedef enum
+{
+    Mem_Offset,
+    Mem_Pre,
+    Mem_Post,
+} mem_mode_t;
+
+// How a load/store encodes its offset.
+typedef enum
+{
+    Imm_None,                   // Exclusives, acquire/release and atomics: just [xn]
+    Imm_U12,                    // Unsigned, scaled
+    Imm_S9,                     // Signed, unscaled
+    Imm_S7,                     // Signed, scaled, for pairs
+    Imm_S10,                    // Signed, scaled by 8, split across bits 22 and 20:12 (ldraa/ldrab)
+} mem_imm_t;
+
+// Register fields a load/store uses besides rt and rn, and which general purpose ones it writes.
+#define MEM_RT2     0x01
+#define MEM_RS      0x02
+#define MEM_WR_RT   0x04        // Also rt2, if used
+#define MEM_WR_RS   0x08
+
+typedef struct
+{
+    const char *name;           // NULL if not a load/store with an immediate or bare base
+    const char *sfx;            // Ordering and size suffix of atomics, e.g. "al" + "b"
+    char rs;                    // Size prefix of the transfer register(s)
+    char ss;                    // Size prefix of rs, if used
+    uint8_t imm;                // mem_imm_t
+    uint8_t scale;
+    uint8_t mode;               // mem_mode_t
+    uint8_t regs;
+} mem_op_t;
+
+// Integer loads and stores, indexed by [unsigned/pre/post, unscaled, unprivileged, rcpc][opc << 2 | size].
+// NULL entries are prefetches or unallocated.
+static const char *const ldst_names[4][16] =
+{
+    { "strb",   "strh",   "str",   "str",   "ldrb",    "ldrh",    "ldr",    "ldr",    "ldrsb",    "ldrsh",    "ldrsw",    NULL, "ldrsb",    "ldrsh",    NULL, NULL },
+    { "sturb",  "sturh",  "stur",  "stur",  "ldurb",   "ldurh",   "ldur",   "ldur",   "ldursb",   "ldursh",   "ldursw",   NULL, "ldursb",   "ldursh",   NULL, NULL },
+    { "sttrb",  "sttrh",  "sttr",  "sttr",  "ldtrb",   "ldtrh",   "ldtr",   "ldtr",   "ldtrsb",   "ldtrsh",   "ldtrsw",   NULL, "ldtrsb",   "ldtrsh",   NULL, NULL },
+    { "stlurb", "stlurh", "stlur", "stlur", "ldapurb", "ldapurh", "ldapur", "ldapur", "ldapursb", "ldapursh", "ldapursw", NULL, "ldapursb", "ldapursh", NULL, NULL },
+};
+
+// Integer pairs, indexed by [no-allocate, other][opc << 1 | L]. SIMD pairs use the opc 0 names.
+static const char *const ldstp_names[2][8] =
+{
+    { "stnp", "ldnp", NULL, NULL,    "stnp", "ldnp", NULL, NULL },
+    { "stp",  "ldp",  NULL, "ldpsw", "stp",  "ldp",  NULL, NULL },
+};
+
+// Exclusives, acquire/release and compare-and-swap, indexed by o2 << 3 | L << 2 | o1 << 1 | o0.
+// The pairs (o2 = 0, o1 = 1) are casp for byte and halfword sizes, which isn't covered.
+static const char *const ldstx_names[16] =
+{
+    "stxr",  "stlxr", "stxp", "stlxp", "ldxr",  "ldaxr", "ldxp", "ldaxp",
+    "stllr", "stlr",  "cas",  "casl",  "ldlar", "ldar",  "casa", "casal",
+};
+
+// LSE atomics, indexed by [o3][opc].
+static const char *const atomic_names[2][8] =
+{
+    { "ldadd", "ldclr", "ldeor", "ldset", "ldsmax", "ldsmin", "ldumax", "ldumin" },
+    { "swp",   NULL,    NULL,    NULL,    "ldapr",  NULL,     NULL,     NULL     },
+};
+
+// Suffixes for atomics, indexed by [A << 1 | R][size].
+static const char *const atomic_sfx[4][4] =
+{
+    { "b",   "h",   "",   ""   },
+    { "lb",  "lh",  "l",  "l"  },
+    { "ab",  "ah",  "a",  "a"  },
+    { "alb", "alh", "al", "al" },
+};
+
+// Loads and stores are looked up by the bits that tell them apart: 31:28, 26 and 24:21,
+// then 15:10. Bits 27 and 25 are fixed for the whole class and left out.
+#define MEM_KEY_BITS 15
+#define MEM_KEY(v) ((((v) >> 28) << 11) | ((((v) >> 26) & 0x1) << 10) | ((((v) >> 21) & 0xf) << 6) | (((v) >> 10) & 0x3f))
+
+static uint16_t mem_key[1 << MEM_KEY_BITS]; // Index into mem_ops, 0 for none
+static mem_op_t mem_ops[0x200];             // A bit under 0x180 are used
+static size_t mem_nops = 1;
+
+// Classifies one load/store, as given by the key bits only. This is only used to fill the table.
+static void mem_classify(uint32_t v, mem_op_t *op)
+{
+    uint32_t size = (v >> 30) & 0x3,
+             opc  = (v >> 22) & 0x3;
+    bool simd = (v & 0x04000000) != 0;
+    memset(op, 0, sizeof(*op));
+    op->sfx = "";
+    if((v & 0x3a000000) == 0x38000000 && (v & 0x01200000) != 0x00200000) // single register, immediate
+    {
+        size_t table = 0;
+        if((v & 0x01000000) != 0) // unsigned offset
+        {
+            op->imm = Imm_U12;
+        }
+        else
+        {
+            op->imm = Imm_S9;
+            switch((v >> 10) & 0x3)
+            {
+                case 0: table = 1;             break;
+                case 1: op->mode = Mem_Post;   break;
+                case 2: table = 2;             break;
+                case 3: op->mode = Mem_Pre;    break;
+            }
+        }
+        if(simd)
+        {
+            // Sizes b, h, s and d, or q with opc 2/3.
+            if(table == 2 || ((opc & 0x2) != 0 && size != 0))
+            {
+                return;
+            }
+            op->name  = table == 1 ? ((opc & 0x1) != 0 ? "ldur" : "stur") : ((opc & 0x1) != 0 ? "ldr" : "str");
+            op->rs    = (opc & 0x2) != 0 ? 'q' : "bhsd"[size];
+            op->scale = (opc & 0x2) != 0 ? 4 : size;
+        }
+        else
+        {
+            op->name  = ldst_names[table][(opc << 2) | size];
+            op->rs    = opc == 2 || (opc < 2 && size == 3) ? 'x' : 'w';
+            op->scale = size;
+            op->regs  = opc != 0 ? MEM_WR_RT : 0;
+        }
+    }
+    else if((v & 0xff200400) == 0xf8200400) // ldraa/ldrab
+    {
+        op->name = (v & 0x00800000) != 0 ? "ldrab" : "ldraa";
+        op->rs   = 'x';
+        op->imm  = Imm_S10;
+        op->mode = (v & 0x800) != 0 ? Mem_Pre : Mem_Offset;
+        op->regs = MEM_WR_RT;
+    }
+    else if((v & 0x3f200c00) == 0x38200000) // atomics
+    {
+        uint32_t o3 = (v >> 15) & 0x1,
+                 aop = (v >> 12) & 0x7;
+        bool ldapr = o3 == 1 && aop == 4;
+        if(ldapr && opc != 2)
+        {
+            return;
+        }
+        op->name = atomic_names[o3][aop];
+        op->sfx  = ldapr ? atomic_sfx[0][size] : atomic_sfx[opc][size];
+        op->rs   = size == 3 ? 'x' : 'w';
+        op->ss   = ldapr ? 0 : op->rs;
+        op->regs = MEM_WR_RT | (ldapr ? 0 : MEM_RS);
+    }
+    else if((v & 0x3f000000) == 0x08000000) // exclusives, acquire/release and cas
+    {
+        uint32_t idx = ((v >> 20) & 0xc) | ((v >> 20) & 0x2) | ((v >> 15) & 0x1);
+        bool pair = (idx & 0xa) == 0x2,
+             cas  = (idx & 0xa) == 0xa;
+        if(pair && size < 2)
+        {
+            return;
+        }
+        op->name = ldstx_names[idx];
+        op->sfx  = pair || size >= 2 ? "" : size == 0 ? "b" : "h";
+        op->rs   = size == 3 ? 'x' : 'w';
+        if(cas)
+        {
+            op->ss   = op->rs;
+            op->regs = MEM_RS | MEM_WR_RS;
+        }
+        else if((idx & 0x4) != 0 || (idx & 0x8) != 0) // loads, and stlr/stllr
+        {
+            op->regs = (idx & 0x4) != 0 ? MEM_WR_RT : 0;
+        }
+        else // store exclusive, with a status register
+        {
+            op->ss   = 'w';
+            op->regs = MEM_RS | MEM_WR_RS;
+        }
+        if(pair)
+        {
+            op->regs |= MEM_RT2;
+        }
+    }
+    else if((v & 0x3f200c00) == 0x19000000) // ldapur/stlur
+    {
+        op->name  = ldst_names[3][(opc << 2) | size];
+        op->rs    = opc == 2 || (opc < 2 && size == 3) ? 'x' : 'w';
+        op->imm   = Imm_S9;
+        op->regs  = opc != 0 ? MEM_WR_RT : 0;
+    }
+    else if((v & 0x3a000000) == 0x28000000) // stp/ldp
+    {
+        uint32_t idx = (v >> 23) & 0x3;
+        bool load = (v & 0x00400000) != 0;
+        if(simd)
+        {
+            op->name  = size == 3 ? NULL : ldstp_names[idx != 0][load];
+            op->rs    = "sdq"[size == 3 ? 0 : size];
+            op->scale = 2 + size;
+        }
+        else
+        {
+            op->name  = ldstp_names[idx != 0][(size << 1) | load];
+            op->rs    = size == 0 ? 'w' : 'x';
+            op->scale = size == 2 ? 3 : 2;
+        }
+        op->imm  = Imm_S7;
+        op->mode = idx == 1 ? Mem_Post : idx == 3 ? Mem_Pre : Mem_Offset;
+        op->regs = MEM_RT2 | (load && !simd ? MEM_WR_RT : 0);
+    }
+}
+
+static void mem_init(void)
+{
+    size_t last = 0;
+    for(uint32_t key = 0; key < (1 << MEM_KEY_BITS); ++key)
+    {
+        uint32_t v = ((key >> 11) << 28) | 0x08000000 | (((key >> 10) & 0x1) << 26) | (((key >> 6) & 0xf) << 21) | ((key & 0x3f) << 10);
+        mem_op_t op;
+        mem_classify(v, &op);
+        if(!op.name)
+        {
+            continue;
+        }
+        // Neighbouring keys mostly differ in immediate bits only, so try the last op first.
+        size_t i = last;
+        if(i == 0 || memcmp(&mem_ops[i], &op, sizeof(op)) != 0)
+        {
+            i = 1;
+            while(i < mem_nops && memcmp(&mem_ops[i], &op, sizeof(op)) != 0)
+            {
+                ++i;
+            }
+        }
+        if(i == mem_nops)
+        {
+            mem_ops[mem_nops++] = op;
+        }
+        mem_key[key] = i;
+        last = i;
+    }
+}
+
+// Loads and stores with an immediate offset or none at all, single or pair.
+// Returns NULL for anything else, including register offsets.
+static const mem_op_t* mem_decode(uint32_t v, int64_t *off)
+{
+    if((v & 0x0a000000) != 0x08000000)
+    {
+        return NULL;
+    }
+    const mem_op_t *op = &mem_ops[mem_key[MEM_KEY(v)]];
+    switch(op->imm)
+    {
+        case Imm_None: *off = 0;                                                                            break;
+        case Imm_U12:  *off = (int64_t)(((v >> 10) & 0xfff) << op->scale);                                  break;
+        case Imm_S9:   *off = (int64_t)((uint64_t)((v >> 12) & 0x1ff) << 55) >> 55;                         break;
+        case Imm_S7:   *off = ((int64_t)((uint64_t)((v >> 15) & 0x7f) << 57) >> 57) * (1 << op->scale);     break;
+        case Imm_S10:  *off = ((int64_t)((uint64_t)(((v >> 13) & 0x200) | ((v >> 12) & 0x1ff)) << 54) >> 54) * 8; break;
+    }
+    return op->name ? op : NULL;
+}
+
+// Whether a chain starting at val could still reach any of the targets.
+static bool reachable(const scan_t *sc, uint64_t val)
+{
+    if(sc->refs)
+    {
+        return true;
+    }
+    uint64_t lo = val + CHAIN_MIN,
+             hi = val + CHAIN_MAX;
+    if(lo > val)
+    {
+        lo = 0;
+    }
+    if(hi < val)
+    {
+        hi = UINT64_MAX;
+    }
+    size_t idx = targets_upper(sc->tg, hi);
+    return idx > 0 && sc->tg->span[idx - 1].reach > lo;
+}
+
+static uint64_t adr_target(uint32_t v, uint64_t addr)
+{
+    bool is_adrp = (v & 0x80000000) != 0;
+    int64_t base = is_adrp ? (addr & 0xfffffffffffff000) : addr;
+    int64_t off  = (int64_t)((uint64_t)((((v >> 5) & 0x7ffff) << 2) | ((v >> 29) & 0x3)) << 43) >> (is_adrp ? 31 : 43);
+    return base + off;
+}
+
+static uint32_t add_imm(uint32_t v)
+{
+    uint32_t off = (v >> 10) & 0xfff;
+    if(v & 0x400000) off <<= 12;
+    return off;
+}
+
+// General purpose registers an instruction may write, as a bitmask.
+// Anything that may transfer control or that isn't understood ends the basic block (~0).
+static uint32_t clobbers(uint32_t v)
+{
+    uint32_t rt  = 1u << (v & 0x1f),
+             rn  = 1u << ((v >> 5) & 0x1f),
+             rt2 = 1u << ((v >> 10) & 0x1f),
+             rs  = 1u << ((v >> 16) & 0x1f);
+    if((v & 0x1c000000) == 0x10000000 || (v & 0x0e000000) == 0x0a000000) // data processing, immediate and register
+    {
+        return rt;
+    }
+    if((v & 0x0a000000) == 0x08000000) // loads and stores
+    {
+        bool simd = (v & 0x04000000) != 0;
+        const mem_op_t *op = &mem_ops[mem_key[MEM_KEY(v)]];
+        if(op->name)
+        {
+            uint32_t m = op->mode != Mem_Offset ? rn : 0;
+            if((op->regs & MEM_WR_RT) != 0) m |= (op->regs & MEM_RT2) != 0 ? rt | rt2 : rt;
+            if((op->regs & MEM_WR_RS) != 0) m |= rs;
+            return m;
+        }
+        if((v & 0x3f000000) == 0x08000000) // casp
+        {
+            return rt | rt2 | rs;
+        }
+        if((v & 0x3b000000) == 0x18000000) // literal
+        {
+            return simd ? 0 : rt;
+        }
+        if((v & 0x3a000000) == 0x38000000) // register offset and everything else with a single register
+        {
+            return !simd && (v & 0x00c00000) != 0 ? rt : 0;
+        }
+        if((v & 0x3e000000) == 0x0c000000) // SIMD structures
+        {
+            return (v & 0x00800000) != 0 ? rn : 0;
+        }
+        return rt | rn;
+    }
+    if((v & 0x0e000000) == 0x0e000000) // SIMD and FP, only some of which write general purpose registers
+    {
+        if((v & 0x5f200000) == 0x1e000000 || (v & 0x5f20fc00) == 0x1e200000 || (v & 0xbfe0ec00) == 0x0e002c00) // conversions, fmov, umov/smov
+        {
+            return rt;
+        }
+        return 0;
+    }
+    if((v & 0x1e000000) == 0x04000000) // SVE
+    {
+        return rt;
+    }
+    if((v & 0xffc00000) == 0xd5000000) // system
+    {
+        if((v & 0xfffff01f) == 0xd503201f) // hints, some of which are pac on x16/x17/x30
+        {
+            return v == 0xd503201f ? 0 : (1u << 16) | (1u << 17) | (1u << 30);
+        }
+        return (v & 0x00200000) != 0 ? rt : 0; // mrs and sysl
+    }
+    return ~0u;
+}
+
+// Records a hit for chain t, to which a final instruction may still be added.
+static hit_t* hit_chain(scan_t *sc, const track_t *t, uint64_t target, ref_kind_t kind)
+{
+    hit_t *hit = hits_add(sc, t->src, target, kind);
+    if(hit)
+    {
+        for(size_t i = 0; i < t->len; ++i)
+        {
+            hit_insn(hit, t->insn[i], t->off[i]);
+        }
+    }
+    return hit;
+}
+
+// Whether an instruction can be skipped while the registers in live are tracked: none of its
+// register fields name one of them, and it's not in a class that may end the basic block.
+static inline bool quiet(uint32_t live, uint32_t v)
+{
+    uint32_t use = (1u << (v & 0x1f)) | (1u << ((v >> 5) & 0x1f)) | (1u << ((v >> 10) & 0x1f)) | (1u << ((v >> 16) & 0x1f));
+    return (live & use) == 0 && (v & 0x1c000000) != 0x14000000 && (v & 0x18000000) != 0;
+}
+
+// Runs one instruction through the tracker. Only prefilter candidates (cand) are matched
+// themselves or start a new chain; everything else just updates the tracked registers.
+// Offsets of zero aren't reported, since the previous instruction in the chain already covers them.
+static void step(scan_t *sc, tracker_t *tr, uint32_t v, uint64_t addr, bool cand)
+{
+    uint32_t rd = v & 0x1f;
+    if((v & 0x1f000000) == 0x10000000) // adr and adrp
+    {
+        bool is_adrp = (v & 0x80000000) != 0;
+        uint64_t target = adr_target(v, addr);
+        if(cand && match(sc, addr, target, is_adrp ? Ref_Adrp : Ref_Adr))
+        {
+            hit_t *hit = hits_add(sc, addr, target, is_adrp ? Ref_Adrp : Ref_Adr);
+            if(hit) hit_insn(hit, v, 0);
+        }
+        if(cand && rd != 31 && reachable(sc, target))
+        {
+            tr->reg[rd] = (track_t){ .src = addr, .val = target, .insn = { v }, .off = { 0 }, .len = 1 };
+            tr->live |= 1u << rd;
+        }
+        else
+        {
+            tr->live &= ~(1u << rd);
+        }
+        return;
+    }
+    if(tr->live)
+    {
+        uint32_t rn = (v >> 5) & 0x1f,
+                 rm = (v >> 16) & 0x1f;
+        const mem_op_t *m;
+        int64_t moff;
+        if((v & 0xff800000) == 0x91000000 && (tr->live & (1u << rn)) != 0) // 64bit add
+        {
+            track_t t = tr->reg[rn];
+            if(t.adds < 2 && t.len < CHAIN_LEN && rd != 31)
+            {
+                uint32_t off = add_imm(v);
+                t.val += off;
+                t.insn[t.len] = v;
+                t.off[t.len++] = addr - t.src;
+                ++t.adds;
+                if(off && match(sc, t.src, t.val, t.adds == 1 ? Ref_Add : Ref_AddAdd))
+                {
+                    hit_chain(sc, &t, t.val, t.adds == 1 ? Ref_Add : Ref_AddAdd);
+                }
+                tr->reg[rd] = t;
+                tr->live |= 1u << rd;
+            }
+            else
+            {
+                tr->live &= ~(1u << rd);
+            }
+            return;
+        }
+        if((v & 0xffe0ffe0) == 0xaa0003e0 && (tr->live & (1u << rm)) != 0) // mov
+        {
+            track_t t = tr->reg[rm];
+            if(t.len < CHAIN_LEN && rd != 31)
+            {
+                t.insn[t.len] = v;
+                t.off[t.len++] = addr - t.src;
+                tr->reg[rd] = t;
+                tr->live |= 1u << rd;
+            }
+            else
+            {
+                tr->live &= ~(1u << rd);
+            }
+            return;
+        }
+        if((tr->live & (1u << rn)) != 0 && (m = mem_decode(v, &moff)) != NULL)
+        {
+            // Post-index accesses the base as-is, then writes it back.
+            const track_t *t = &tr->reg[rn];
+            if(m->mode != Mem_Post && moff != 0 && match(sc, t->src, t->val + moff, Ref_Mem))
+            {
+                hit_t *hit = hit_chain(sc, t, t->val + moff, Ref_Mem);
+                if(hit) hit_insn(hit, v, addr - t->src);
+            }
+        }
+    }
+    if(cand)
+    {
+        int64_t off = 0;
+        ref_kind_t kind = Ref_LdrLit;
+        bool is_ref = true;
+        if((v & 0xbf000000) == 0x18000000 || (v & 0xff000000) == 0x98000000) // ldr and ldrsw literal
+        {
+            off  = (int64_t)((uint64_t)((v >> 5) & 0x7ffff) << 45) >> 43;
+        }
+        else if((v & 0x7c000000) == 0x14000000) // b and bl
+        {
+            off  = (int64_t)((uint64_t)(v & 0x3ffffff) << 38) >> 36;
+            kind = (v & 0x80000000) != 0 ? Ref_Bl : Ref_B;
+        }
+        else if((v & 0xff000010) == 0x54000000) // b.cond
+        {
+            off  = (int64_t)((uint64_t)((v >> 5) & 0x7ffff) << 45) >> 43;
+            kind = Ref_BCond;
+        }
+        else if((v & 0x7e000000) == 0x34000000) // cbz and cbnz
+        {
+            off  = (int64_t)((uint64_t)((v >> 5) & 0x7ffff) << 45) >> 43;
+            kind = Ref_Cbz;
+        }
+        else if((v & 0x7e000000) == 0x36000000) // tbz and tbnz
+        {
+            off  = (int64_t)((uint64_t)((v >> 5) & 0x3fff) << 50) >> 48;
+            kind = Ref_Tbz;
+        }
+        else
+        {
+            is_ref = false;
+        }
+        if(is_ref && match(sc, addr, addr + off, kind))
+        {
+            hit_t *hit = hits_add(sc, addr, addr + off, kind);
+            if(hit) hit_insn(hit, v, 0);
+        }
+    }
+    if(tr->live)
+    {
+        tr->live &= ~clobbers(v);
+    }
+}
+
+// Cheap prefilter for the instructions that start a reference: adr/adrp, ldr/ldrsw literal,
+// b/bl, b.cond, cbz/cbnz and tbz/tbnz. Besides the opcode class, it also extracts each
+// candidate's PC-relative immediate and checks it against the window of offsets that could
+// possibly reach a target. Only the few words that pass both are handed to the tracker.
+// The vector versions do PREFILTER_WORDS words per call.
+#define PREFILTER_WORDS 16
+
+// Bounds are inclusive. [0] applies to branch and literal byte offsets, [1] to adr byte offsets
+// and [2] to adrp page offsets.
+typedef struct
+{
+    int32_t lo[3];
+    int32_t hi[3];
+} pf_win_t;
+
+static inline int32_t clamp32(int64_t x)
+{
+    return x < INT32_MIN ? INT32_MIN : x > INT32_MAX ? INT32_MAX : (int32_t)x;
+}
+
+// a - b without wrapping around, saturated well within int64_t so the chain bounds can still be applied.
+static inline int64_t distance(uint64_t a, uint64_t b)
+{
+    uint64_t d = a >= b ? a - b : b - a;
+    int64_t x = d > (1ULL << 62) ? (1LL << 62) : (int64_t)d;
+    return a >= b ? x : -x;
+}
+
+// Window for a block of PREFILTER_WORDS instructions starting at base.
+static void pf_window(const scan_t *sc, uint64_t base, pf_win_t *w)
+{
+    if(sc->refs || sc->tg->num == 0)
+    {
+        for(size_t i = 0; i < 3; ++i)
+        {
+            w->lo[i] = INT32_MIN;
+            w->hi[i] = INT32_MAX;
+        }
+        return;
+    }
+    uint64_t last = base + 4 * (PREFILTER_WORDS - 1),
+             tmin = sc->tg->span[0].lo,
+             tmax = sc->tg->span[sc->tg->num - 1].reach - 1;
+    int64_t lo = distance(tmin, last),
+            hi = distance(tmax, base);
+    w->lo[0] = clamp32(lo);
+    w->hi[0] = clamp32(hi);
+    w->lo[1] = clamp32(lo - CHAIN_MAX);
+    w->hi[1] = clamp32(hi - CHAIN_MIN);
+    w->lo[2] = clamp32((distance(tmin, last & ~0xfffULL) - CHAIN_MAX) >> 12);
+    w->hi[2] = clamp32((distance(tmax, base & ~0xfffULL) - CHAIN_MIN) >> 12);
+}
+
+static inline bool pf_word(uint32_t v, const pf_win_t *w)
+{
+    int32_t off19 = ((int32_t)(v << 8) >> 11) & ~3;
+    if((v & 0x7c000000) == 0x14000000) // b and bl
+    {
+        int32_t off = (int32_t)(v << 6) >> 4;
+        return off >= w->lo[0] && off <= w->hi[0];
+    }
+    if((v & 0xbf000000) == 0x18000000 || (v & 0xff000000) == 0x98000000 || (v & 0xff000010) == 0x54000000 || (v & 0x7e000000) == 0x34000000) // ldr literal, b.cond, cbz
+    {
+        return off19 >= w->lo[0] && off19 <= w->hi[0];
+    }
+    if((v & 0x7e000000) == 0x36000000) // tbz
+    {
+        int32_t off = ((int32_t)(v << 13) >> 16) & ~3;
+        return off >= w->lo[0] && off <= w->hi[0];
+    }
+    if((v & 0x1f000000) == 0x10000000) // adr and adrp
+    {
+        int32_t off = off19 | ((v >> 29) & 0x3);
+        size_t i = (v & 0x80000000) != 0 ? 2 : 1;
+        return off >= w->lo[i] && off <= w->hi[i];
+    }
+    return false;
+}
+
+static uint32_t prefilter_scalar(const uint32_t *p, const pf_win_t *w)
+{
+    uint32_t mask = 0;
+    for(size_t i = 0; i < PREFILTER_WORDS; ++i)
+    {
+        mask |= (uint32_t)pf_word(p[i], w) << i;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#   include <immintrin.h>
+
+#define PF_IS(v, mask, val) _mm_cmpeq_epi32(_mm_and_si128(v, _mm_set1_epi32((int)(mask))), _mm_set1_epi32((int)(val)))
+#define PF_IN(off, i)       _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi32(_mm_set1_epi32(w->lo[i]), off), _mm_cmpgt_epi32(off, _mm_set1_epi32(w->hi[i]))), _mm_set1_epi32(-1))
+
+static uint32_t prefilter_sse2(const uint32_t *p, const pf_win_t *w)
+{
+    uint32_t mask = 0;
+    for(size_t i = 0; i < PREFILTER_WORDS / 4; ++i)
+    {
+        __m128i v     = _mm_loadu_si128((const __m128i*)p + i),
+                off26 = _mm_srai_epi32(_mm_slli_epi32(v, 6), 4),
+                off19 = _mm_and_si128(_mm_srai_epi32(_mm_slli_epi32(v, 8), 11), _mm_set1_epi32(~3)),
+                off14 = _mm_and_si128(_mm_srai_epi32(_mm_slli_epi32(v, 13), 16), _mm_set1_epi32(~3)),
+                off21 = _mm_or_si128(off19, _mm_and_si128(_mm_srli_epi32(v, 29), _mm_set1_epi32(0x3))),
+                is19  = _mm_or_si128(_mm_or_si128(PF_IS(v, 0xbf000000, 0x18000000), PF_IS(v, 0xff000000, 0x98000000)), _mm_or_si128(PF_IS(v, 0xff000010, 0x54000000), PF_IS(v, 0x7e000000, 0x34000000))),
+                m     = _mm_and_si128(PF_IS(v, 0x7c000000, 0x14000000), PF_IN(off26, 0));
+        m = _mm_or_si128(m, _mm_and_si128(is19, PF_IN(off19, 0)));
+        m = _mm_or_si128(m, _mm_and_si128(PF_IS(v, 0x7e000000, 0x36000000), PF_IN(off14, 0)));
+        m = _mm_or_si128(m, _mm_and_si128(PF_IS(v, 0x9f000000, 0x10000000), PF_IN(off21, 1)));
+        m = _mm_or_si128(m, _mm_and_si128(PF_IS(v, 0x9f000000, 0x90000000), PF_IN(off21, 2)));
+        mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(m)) << (4 * i);
+    }
+    return mask;
+}
+
+#undef PF_IS
+#undef PF_IN
+#define PF_IS(v, mask, val) _mm256_cmpeq_epi32(_mm256_and_si256(v, _mm256_set1_epi32((int)(mask))), _mm256_set1_epi32((int)(val)))
+#define PF_IN(off, i)       _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(w->lo[i]), off), _mm256_cmpgt_epi32(off, _mm256_set1_epi32(w->hi[i]))), _mm256_set1_epi32(-1))
+
+__attribute__((target("avx2"))) static uint32_t prefilter_avx2(const uint32_t *p, const pf_win_t *w)
+{
+    uint32_t mask = 0;
+    for(size_t i = 0; i < PREFILTER_WORDS / 8; ++i)
+    {
+        __m256i v     = _mm256_loadu_si256((const __m256i*)p + i),
+                off26 = _mm256_srai_epi32(_mm256_slli_epi32(v, 6), 4),
+                off19 = _mm256_and_si256(_mm256_srai_epi32(_mm256_slli_epi32(v, 8), 11), _mm256_set1_epi32(~3)),
+                off14 = _mm256_and_si256(_mm256_srai_epi32(_mm256_slli_epi32(v, 13), 16), _mm256_set1_epi32(~3)),
+                off21 = _mm256_or_si256(off19, _mm256_and_si256(_mm256_srli_epi32(v, 29), _mm256_set1_epi32(0x3))),
+                is19  = _mm256_or_si256(_mm256_or_si256(PF_IS(v, 0xbf000000, 0x18000000), PF_IS(v, 0xff000000, 0x98000000)), _mm256_or_si256(PF_IS(v, 0xff000010, 0x54000000), PF_IS(v, 0x7e000000, 0x34000000))),
+                m     = _mm256_and_si256(PF_IS(v, 0x7c000000, 0x14000000), PF_IN(off26, 0));
+        m = _mm256_or_si256(m, _mm256_and_si256(is19, PF_IN(off19, 0)));
+        m = _mm256_or_si256(m, _mm256_and_si256(PF_IS(v, 0x7e000000, 0x36000000), PF_IN(off14, 0)));
+        m = _mm256_or_si256(m, _mm256_and_si256(PF_IS(v, 0x9f000000, 0x10000000), PF_IN(off21, 1)));
+        m = _mm256_or_si256(m, _mm256_and_si256(PF_IS(v, 0x9f000000, 0x90000000), PF_IN(off21, 2)));
+        mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(m)) << (8 * i);
+    }
+    return mask;
+}
+
+#undef PF_IS
+#undef PF_IN
+#elif defined(__aarch64__)
+#   include <arm_neon.h>
+
+#define PF_IS(v, mask, val) vceqq_u32(vandq_u32(v, vdupq_n_u32(mask)), vdupq_n_u32(val))
+#define PF_IN(off, i)       vandq_u32(vcgeq_s32(off, vdupq_n_s32(w->lo[i])), vcleq_s32(off, vdupq_n_s32(w->hi[i])))
+
+static uint32_t prefilter_neon(const uint32_t *p, const pf_win_t *w)
+{
+    static const uint32_t bits[4] = { 1, 2, 4, 8 };
+    uint32x4_t b = vld1q_u32(bits);
+    uint32_t mask = 0;
+    for(size_t i = 0; i < PREFILTER_WORDS / 4; ++i)
+    {
+        uint32x4_t v     = vld1q_u32(p + 4 * i);
+        int32x4_t  off26 = vshrq_n_s32(vreinterpretq_s32_u32(vshlq_n_u32(v, 6)), 4),
+                   off19 = vandq_s32(vshrq_n_s32(vreinterpretq_s32_u32(vshlq_n_u32(v, 8)), 11), vdupq_n_s32(~3)),
+                   off14 = vandq_s32(vshrq_n_s32(vreinterpretq_s32_u32(vshlq_n_u32(v, 13)), 16), vdupq_n_s32(~3)),
+                   off21 = vorrq_s32(off19, vreinterpretq_s32_u32(vandq_u32(vshrq_n_u32(v, 29), vdupq_n_u32(3))));
+        uint32x4_t is19  = vorrq_u32(vorrq_u32(PF_IS(v, 0xbf000000, 0x18000000), PF_IS(v, 0xff000000, 0x98000000)), vorrq_u32(PF_IS(v, 0xff000010, 0x54000000), PF_IS(v, 0x7e000000, 0x34000000))),
+                   m     = vandq_u32(PF_IS(v, 0x7c000000, 0x14000000), PF_IN(off26, 0));
+        m = vorrq_u32(m, vandq_u32(is19, PF_IN(off19, 0)));
+        m = vorrq_u32(m, vandq_u32(PF_IS(v, 0x7e000000, 0x36000000), PF_IN(off14, 0)));
+        m = vorrq_u32(m, vandq_u32(PF_IS(v, 0x9f000000, 0x10000000), PF_IN(off21, 1)));
+        m = vorrq_u32(m, vandq_u32(PF_IS(v, 0x9f000000, 0x90000000), PF_IN(off21, 2)));
+        mask |= vaddvq_u32(vandq_u32(m, b)) << (4 * i);
+    }
+    return mask;
+}
+
+#undef PF_IS
+#undef PF_IN
+#endif
+
+static uint32_t (*prefilter)(const uint32_t *p, const pf_win_t *w) = prefilter_scalar;
+
+// Runs the selected prefilter side by side with the scalar one on pseudo-random words, a lot of
+// them forced into the classes it looks for, under random windows. Every other round, immediates
+// and windows are kept small, so that offsets land right at the window bounds. Returns whether
+// they agree.
+static bool prefilter_check(void)
+{
+    static const uint32_t cls[][2] =
+    {
+        { 0x7c000000, 0x14000000 }, // b and bl
+        { 0xbf000000, 0x18000000 }, // ldr literal
+        { 0xff000010, 0x54000000 }, // b.cond
+        { 0x7e000000, 0x36000000 }, // tbz
+        { 0x1f000000, 0x10000000 }, // adr and adrp, either op bit
+    };
+    uint32_t x = 0x2545f491,
+             p[PREFILTER_WORDS];
+    for(size_t n = 0; n < 0x1000; ++n)
+    {
+        bool small = n & 1;
+        pf_win_t w;
+        for(size_t i = 0; i < 3; ++i)
+        {
+            // Branch offsets are bytes, the others are within 21 bits.
+            int shift = small ? 25 : i == 0 ? 3 : 11;
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            int32_t a = (int32_t)x >> shift;
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            int32_t b = (int32_t)x >> shift;
+            w.lo[i] = a < b ? a : b;
+            w.hi[i] = a < b ? b : a;
+        }
+        for(size_t i = 0; i < PREFILTER_WORDS; ++i)
+        {
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            size_t c = x % 8;
+            uint32_t v = x;
+            if(small)
+            {
+                // Bits 5 to 25 hold (the top of) every immediate, fill them with a sign-extended nibble.
+                v = (v & ~0x03ffffe0) | (((uint32_t)((int32_t)(x << 4) >> 28) & 0x1fffff) << 5);
+            }
+            p[i] = c < sizeof(cls)/sizeof(cls[0]) ? (v & ~cls[c][0]) | cls[c][1] : v;
+        }
+        if(prefilter(p, &w) != prefilter_scalar(p, &w))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void prefilter_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    prefilter = __builtin_cpu_supports("avx2") ? prefilter_avx2 : __builtin_cpu_supports("sse2") ? prefilter_sse2 : prefilter_scalar;
+#elif defined(__aarch64__)
+    prefilter = prefilter_neon;
+#endif
+    if(prefilter != prefilter_scalar && !prefilter_check())
+    {
+        fprintf(stderr, "Vector prefilter disagrees with the scalar one, using the scalar one.\n");
+        prefilter = prefilter_scalar;
+    }
+}
+
+// Runs n instructions through the tracker, given their prefilter mask. While nothing is tracked,
+// only candidates need decoding; once a chain is live, every instruction does.
+static void scan_block(scan_t *sc, tracker_t *tr, const uint32_t *p, size_t n, uint64_t addr, uint32_t mask)
+{
+    sc->cands += __builtin_popcount(mask);
+    for(size_t i = 0; i < n; ++i)
+    {
+        if(!tr->live)
+        {
+            if((mask >> i) == 0)
+            {
+                break;
+            }
+            i += __builtin_ctz(mask >> i);
+        }
+        bool cand = ((mask >> i) & 1) != 0;
+        if(cand || !quiet(tr->live, p[i]))
+        {
+            step(sc, tr, p[i], addr + 4 * i, cand);
+        }
+    }
+}
+
+// Scans n instructions at p. Chains still live at the end are left in tr,
+// so that the instructions following them can be fed in with another call.
+static void scan_words(scan_t *sc, tracker_t *tr, const uint32_t *p, size_t n, uint64_t addr)
+{
+    pf_win_t w;
+    const uint32_t *e = p + n;
+    sc->words += n;
+    for(; e - p >= PREFILTER_WORDS; p += PREFILTER_WORDS, addr += 4 * PREFILTER_WORDS)
+    {
+        pf_window(sc, addr, &w);
+        uint32_t mask = prefilter(p, &w);
+        if(mask || tr->live)
+        {
+            scan_block(sc, tr, p, PREFILTER_WORDS, addr, mask);
+        }
+    }
+    if(p < e)
+    {
+        uint32_t mask = 0;
+        pf_window(sc, addr, &w);
+        for(size_t i = 0; i < (size_t)(e - p); ++i)
+        {
+            mask |= (uint32_t)pf_word(p[i], &w) << i;
+        }
+        scan_block(sc, tr, p, e - p, addr, mask);
+    }
+}
+
+// Scans the instructions in [from, to) of r. Chains still live at to are followed further,
+// but nothing past it is reported on its own.
+static void scan_range(scan_t *sc, const range_t *r, size_t from, size_t to)
+{
+    tracker_t tr;
+    tr.live = 0;
+    scan_words(sc, &tr, r->p + from, to - from, r->addr + from * 4);
+    uint64_t addr = r->addr + to * 4;
+    const uint32_t *p = r->p + to;
+    // Finish chains that started before to, without starting new ones.
+    for(; tr.live && p < r->e; ++p, addr += 4)
+    {
+        if(!quiet(tr.live, *p))
+        {
+            step(sc, &tr, *p, addr, false);
+        }
+    }
+}
+
+// Output stage. Hits are formatted into a large buffer that's written out whenever it fills up.
+#define OUT_SIZE 0x100000
+
+typedef enum
+{
+    Fmt_Text,
+    Fmt_Json,   // One object per line
+    Fmt_Bin,    // hit_hdr_t, then raw hit_t records
+} fmt_t;
+
+typedef struct
+{
+    const targets_t *tg;
+    const owners_t *own; // If set, hits are tagged with their fileset entry, if they're in one
+    bool only_own;       // Hits in no entry are dropped instead, as only the ones in own were selected
+    const funcs_t *fn;   // If set, hits are tagged with the function they're in
+    const strs_t *str;   // If set, hits are tagged with the string they load
+    uint32_t kinds;      // If nonzero, only hits of these kinds (as bits) are printed
+    const char *path;    // With several files, the one hits are currently from
+    bool pending;        // Its header hasn't been printed yet
+    bool grouped;        // Some file's header has been printed
+    uint64_t count[Ref_Ptr + 1]; // Hits printed, by kind
+    uint64_t time;       // Nanoseconds spent printing them
+    fmt_t fmt;
+    int fd;
+    char *buf;
+    size_t len;
+    bool fail;
+} out_t;
+
+static const char *const ref_names[] =
+{
+    [Ref_Adr]    = "adr",
+    [Ref_Adrp]   = "adrp",
+    [Ref_Add]    = "add",
+    [Ref_AddAdd] = "add_add",
+    [Ref_Mem]    = "mem",
+    [Ref_LdrLit] = "ldr_lit",
+    [Ref_B]      = "b",
+    [Ref_Bl]     = "bl",
+    [Ref_BCond]  = "b_cond",
+    [Ref_Cbz]    = "cbz",
+    [Ref_Tbz]    = "tbz",
+    [Ref_Ptr]    = "ptr",
+};
+
+static const char *const cond_names[16] =
+{
+    "eq", "ne", "hs", "lo", "mi", "pl", "vs", "vc", "hi", "ls", "ge", "lt", "gt", "le", "al", "nv",
+};
+
+static void out_flush(out_t *o)
+{
+    for(size_t off = 0; off < o->len && !o->fail; )
+    {
+        ssize_t r = write(o->fd, o->buf + off, o->len - off);
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "write: %s\n", strerror(errno));
+            o->fail = true;
+            break;
+        }
+        off += r;
+    }
+    o->len = 0;
+}
+
+// Returns room for at least n bytes, n must not exceed OUT_SIZE.
+static inline char* out_reserve(out_t *o, size_t n)
+{
+    if(OUT_SIZE - o->len < n)
+    {
+        out_flush(o);
+    }
+    return o->buf + o->len;
+}
+
+static void out_mem(out_t *o, const void *p, size_t n)
+{
+    memcpy(out_reserve(o, n), p, n);
+    o->len += n;
+}
+
+static void out_str(out_t *o, const char *str)
+{
+    out_mem(o, str, strlen(str));
+}
+
+// Same as printf's %#llx.
+static void out_hex(out_t *o, uint64_t v)
+{
+    char *p = out_reserve(o, 18);
+    if(v == 0)
+    {
+        p[0] = '0';
+        o->len += 1;
+        return;
+    }
+    size_t n = (64 - __builtin_clzll(v) + 3) / 4;
+    p[0] = '0';
+    p[1] = 'x';
+    for(size_t i = n; i > 0; --i, v >>= 4)
+    {
+        p[1 + i] = "0123456789abcdef"[v & 0xf];
+    }
+    o->len += 2 + n;
+}
+
+static void out_shex(out_t *o, int64_t v)
+{
+    if(v < 0)
+    {
+        out_mem(o, "-", 1);
+    }
+    out_hex(o, v < 0 ? -(uint64_t)v : (uint64_t)v);
+}
+
+static void out_dec(out_t *o, uint32_t v)
+{
+    char tmp[10];
+    size_t n = 0;
+    do
+    {
+        tmp[sizeof(tmp) - ++n] = '0' + v % 10;
+        v /= 10;
+    } while(v);
+    out_mem(o, tmp + sizeof(tmp) - n, n);
+}
+
+static void out_reg(out_t *o, char rs, uint32_t reg)
+{
+    out_mem(o, &rs, 1);
+    out_dec(o, reg);
+}
+
+// Disassembles one of the instructions that hits are made of.
+static void out_insn(out_t *o, uint32_t v, uint64_t addr)
+{
+    const mem_op_t *m;
+    int64_t moff;
+    if((v & 0x1f000000) == 0x10000000) // adr and adrp
+    {
+        out_str(o, (v & 0x80000000) != 0 ? "adrp " : "adr ");
+        out_reg(o, 'x', v & 0x1f);
+        out_str(o, ", ");
+        out_hex(o, adr_target(v, addr));
+    }
+    else if((v & 0xff800000) == 0x91000000) // 64bit add
+    {
+        out_str(o, "add ");
+        out_reg(o, 'x', v & 0x1f);
+        out_str(o, ", ");
+        out_reg(o, 'x', (v >> 5) & 0x1f);
+        out_str(o, ", ");
+        out_hex(o, add_imm(v));
+    }
+    else if((v & 0xffe0ffe0) == 0xaa0003e0) // mov
+    {
+        out_str(o, "mov ");
+        out_reg(o, 'x', v & 0x1f);
+        out_str(o, ", ");
+        out_reg(o, 'x', (v >> 16) & 0x1f);
+    }
+    else if((m = mem_decode(v, &moff)) != NULL)
+    {
+        out_str(o, m->name);
+        out_str(o, m->sfx);
+        out_str(o, " ");
+        if((m->regs & MEM_RS) != 0)
+        {
+            out_reg(o, m->ss, (v >> 16) & 0x1f);
+            out_str(o, ", ");
+        }
+        out_reg(o, m->rs, v & 0x1f);
+        out_str(o, ", ");
+        if((m->regs & MEM_RT2) != 0)
+        {
+            out_reg(o, m->rs, (v >> 10) & 0x1f);
+            out_str(o, ", ");
+        }
+        out_str(o, "[");
+        out_reg(o, 'x', (v >> 5) & 0x1f);
+        if(m->imm == Imm_None)
+        {
+            out_str(o, "]");
+        }
+        else
+        {
+            out_str(o, m->mode == Mem_Post ? "], " : ", ");
+            out_shex(o, moff);
+            out_str(o, m->mode == Mem_Offset ? "]" : m->mode == Mem_Pre ? "]!" : "");
+        }
+    }
+    else if((v & 0xbf000000) == 0x18000000 || (v & 0xff000000) == 0x98000000) // ldr and ldrsw literal
+    {
+        bool is_ldrsw = (v & 0xff000000) == 0x98000000;
+        out_str(o, is_ldrsw ? "ldrsw " : "ldr ");
+        out_reg(o, is_ldrsw || (v & 0x40000000) != 0 ? 'x' : 'w', v & 0x1f);
+        out_str(o, ", ");
+        out_hex(o, addr + ((int64_t)((uint64_t)((v >> 5) & 0x7ffff) << 45) >> 43));
+    }
+    else if((v & 0x7c000000) == 0x14000000) // b and bl
+    {
+        out_str(o, (v & 0x80000000) != 0 ? "bl " : "b ");
+        out_hex(o, addr + ((int64_t)((uint64_t)(v & 0x3ffffff) << 38) >> 36));
+    }
+    else if((v & 0xff000010) == 0x54000000) // b.cond
+    {
+        out_str(o, "b.");
+        out_str(o, cond_names[v & 0xf]);
+        out_str(o, " ");
+        out_hex(o, addr + ((int64_t)((uint64_t)((v >> 5) & 0x7ffff) << 45) >> 43));
+    }
+    else if((v & 0x7e000000) == 0x34000000) // cbz and cbnz
+    {
+        out_str(o, (v & 0x01000000) != 0 ? "cbnz " : "cbz ");
+        out_reg(o, (v & 0x80000000) != 0 ? 'x' : 'w', v & 0x1f);
+        out_str(o, ", ");
+        out_hex(o, addr + ((int64_t)((uint64_t)((v >> 5) & 0x7ffff) << 45) >> 43));
+    }
+    else if((v & 0x7e000000) == 0x36000000) // tbz and tbnz
+    {
+        uint32_t bit = ((v >> 19) & 0x1f) | ((v >> 26) & 0x20);
+        out_str(o, (v & 0x01000000) != 0 ? "tbnz " : "tbz ");
+        out_reg(o, bit > 31 ? 'x' : 'w', v & 0x1f);
+        out_str(o, ", ");
+        out_dec(o, bit);
+        out_str(o, ", ");
+        out_hex(o, addr + ((int64_t)((uint64_t)((v >> 5) & 0x3fff) << 50) >> 48));
+    }
+    else
+    {
+        out_str(o, ".long ");
+        out_hex(o, v);
+    }
+}
+
+// Same as out_mem, but escaped for a JSON string.
+static void out_jmem(out_t *o, const char *str, size_t len)
+{
+    while(len)
+    {
+        size_t n = 0;
+        while(n < len && str[n] != '"' && str[n] != '\\' && (unsigned char)str[n] >= 0x20)
+        {
+            ++n;
+        }
+        out_mem(o, str, n);
+        str += n;
+        len -= n;
+        if(len)
+        {
+            unsigned char c = *str++;
+            --len;
+            char esc[6] = { '\\', 'u', '0', '0', "0123456789abcdef"[c >> 4], "0123456789abcdef"[c & 0xf] };
+            if(c == '"' || c == '\\')
+            {
+                esc[1] = c;
+                out_mem(o, esc, 2);
+            }
+            else
+            {
+                out_mem(o, esc, 6);
+            }
+        }
+    }
+}
+
+static void out_jstr(out_t *o, const char *str)
+{
+    out_jmem(o, str, strlen(str));
+}
+
+// Function as name+off, or start+off if it has no name.
+static void out_func(out_t *o, const func_t *f, uint64_t addr)
+{
+    if(f->name)
+    {
+        out_str(o, f->name);
+    }
+    else
+    {
+        out_hex(o, f->addr);
+    }
+    out_str(o, "+");
+    out_hex(o, addr - f->addr);
+}
+
+// s is the target span it's reported under, if any.
+static void out_hit(out_t *o, const hit_t *hit, const char *entry, const span_t *s)
+{
+    // Pointers are in data, which isn't part of any function.
+    const func_t *f = o->fn && hit->kind != Ref_Ptr ? funcs_find(o->fn, hit->source) : NULL;
+    const str_t *str = o->str ? strs_find(o->str, hit->target) : NULL;
+    bool range = s && s->hi - s->lo > 1;
+    if(o->fmt == Fmt_Bin)
+    {
+        out_mem(o, hit, sizeof(*hit));
+    }
+    else if(o->fmt == Fmt_Json)
+    {
+        out_str(o, "{");
+        if(o->path)
+        {
+            out_str(o, "\"file\":\"");
+            out_jstr(o, o->path);
+            out_str(o, "\",");
+        }
+        out_str(o, "\"source\":\"");
+        out_hex(o, hit->source);
+        out_str(o, "\",\"target\":\"");
+        out_hex(o, hit->target);
+        out_str(o, "\",\"kind\":\"");
+        out_str(o, ref_names[hit->kind]);
+        if(entry)
+        {
+            out_str(o, "\",\"entry\":\"");
+            out_jstr(o, entry);
+        }
+        if(f)
+        {
+            out_str(o, "\",\"func\":\"");
+            out_hex(o, f->addr);
+            if(f->name)
+            {
+                out_str(o, "\",\"func_name\":\"");
+                out_jstr(o, f->name);
+            }
+            out_str(o, "\",\"func_offset\":\"");
+            out_hex(o, hit->source - f->addr);
+        }
+        if(range)
+        {
+            out_str(o, "\",\"range\":\"");
+            out_hex(o, s->lo);
+            out_str(o, "\",\"offset\":\"");
+            out_hex(o, hit->target - s->lo);
+        }
+        if(str)
+        {
+            out_str(o, "\",\"string\":\"");
+            out_jmem(o, str->p, str->hi - str->lo);
+        }
+        out_str(o, "\",\"insns\":[");
+        for(size_t i = 0; i < hit->len; ++i)
+        {
+            out_str(o, i == 0 ? "{\"addr\":\"" : ",{\"addr\":\"");
+            out_hex(o, hit->source + hit->off[i]);
+            out_str(o, "\",\"op\":\"");
+            out_hex(o, hit->insn[i]);
+            out_str(o, "\",\"reg\":");
+            if(hit->reg[i] == 0xff)
+            {
+                out_str(o, "null");
+            }
+            else
+            {
+                out_dec(o, hit->reg[i]);
+            }
+            out_str(o, ",\"text\":\"");
+            out_insn(o, hit->insn[i], hit->source + hit->off[i]);
+            out_str(o, "\"}");
+        }
+        out_str(o, "]}\n");
+    }
+    else
+    {
+        // In batch mode, hits are prefixed with the query they belong to.
+        // Hits inside a range always are, with their offset into it.
+        if(range)
+        {
+            out_str(o, "[");
+            out_hex(o, s->lo);
+            out_str(o, "+");
+            out_hex(o, hit->target - s->lo);
+            out_str(o, "] ");
+        }
+        else if(o->tg->multi)
+        {
+            out_str(o, "[");
+            out_hex(o, hit->target);
+            out_str(o, "] ");
+        }
+        out_hex(o, hit->source);
+        if(entry)
+        {
+            out_str(o, " (");
+            out_str(o, entry);
+            out_str(o, ")");
+        }
+        if(f)
+        {
+            out_str(o, " <");
+            out_func(o, f, hit->source);
+            out_str(o, ">");
+        }
+        out_str(o, ": ");
+        if(hit->kind == Ref_Ptr)
+        {
+            out_str(o, "ptr ");
+            out_hex(o, hit->target);
+        }
+        for(size_t i = 0; i < hit->len; ++i)
+        {
+            if(i > 0)
+            {
+                out_str(o, "; ");
+            }
+            out_insn(o, hit->insn[i], hit->source + hit->off[i]);
+        }
+        if(str)
+        {
+            out_str(o, " -> \"");
+            out_jmem(o, str->p, str->hi - str->lo);
+            out_str(o, "\"");
+        }
+        out_str(o, "\n");
+    }
+}
+
+// Code before data pointers, then by address. A hit is only added once its chain is complete,
+// so a scan collects them slightly out of order.
+static int hits_cmp(const void *a, const void *b)
+{
+    const hit_t *x = a,
+                *y = b;
+    bool px = x->kind == Ref_Ptr,
+         py = y->kind == Ref_Ptr;
+    if(px != py) return px ? 1 : -1;
+    if(x->source != y->source) return x->source < y->source ? -1 : 1;
+    if(x->target != y->target) return x->target < y->target ? -1 : 1;
+    if(x->kind != y->kind) return x->kind < y->kind ? -1 : 1;
+    return memcmp(x->insn, y->insn, sizeof(x->insn));
+}
+
+// Formats and clears all collected hits, sorted with hits_cmp().
+static void out_hits(out_t *o, hits_t *hits)
+{
+    uint64_t start = now_ns();
+    qsort(hits->hit, hits->num, sizeof(*hits->hit), hits_cmp);
+    for(size_t i = 0; i < hits->num; ++i)
+    {
+        const char *entry = NULL;
+        if(o->kinds && ((o->kinds >> hits->hit[i].kind) & 1) == 0)
+        {
+            continue;
+        }
+        if(o->own)
+        {
+            const owner_t *ow = owners_find(o->own, hits->hit[i].source);
+            if(!ow && o->only_own)
+            {
+                continue;
+            }
+            entry = ow ? ow->name : NULL;
+        }
+        if(o->pending && o->fmt == Fmt_Text)
+        {
+            out_str(o, o->grouped ? "\n==> " : "==> ");
+            out_str(o, o->path);
+            out_str(o, " <==\n");
+            o->grouped = true;
+        }
+        o->pending = false;
+        ++o->count[hits->hit[i].kind];
+        // Once under every target span it falls into, except in binary output, which has no spans.
+        const span_t *s = targets_next(o->tg, hits->hit[i].target, NULL);
+        do
+        {
+            out_hit(o, &hits->hit[i], entry, s);
+        } while(o->fmt != Fmt_Bin && s && (s = targets_next(o->tg, hits->hit[i].target, s)) != NULL);
+    }
+    hits->num = 0;
+    o->time += now_ns() - start;
+}
+
+static bool image_parse(image_t *img, uint8_t *file, uint64_t filesize, mach_hdr_t *hdr)
+{
+    memset(img, 0, sizeof(*img));
+    img->file = file;
+    img->filesize = filesize;
+    img->hdr = hdr;
+    if(hdr->magic != MH_MAGIC_64)
+    {
+        fprintf(stderr, "Not a 64-bit Mach-O.\n");
+        return false;
+    }
+    if(hdr->cputype != CPU_TYPE_ARM64)
+    {
+        fprintf(stderr, "Not an arm64 binary.\n");
+        return false;
+    }
+    uint64_t hdroff = (uintptr_t)hdr - (uintptr_t)file;
+    if(hdr->sizeofcmds > filesize - hdroff - sizeof(*hdr))
+    {
+        fprintf(stderr, "File too small for Mach-O load commands.\n");
+        return false;
+    }
+    img->seg = malloc((hdr->ncmds ? hdr->ncmds : 1) * sizeof(*img->seg));
+    if(!img->seg)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        return false;
+    }
+    for(mach_lc_t *lc = (mach_lc_t*)(hdr + 1), *end = (mach_lc_t*)((uintptr_t)lc + hdr->sizeofcmds); lc < end; lc = (mach_lc_t*)((uintptr_t)lc + lc->cmdsize))
+    {
+        size_t space = (uintptr_t)end - (uintptr_t)lc;
+        if(sizeof(*lc) > space || lc->cmdsize > space || lc->cmdsize < sizeof(*lc))
+        {
+            fprintf(stderr, "File too small for Mach-O load command.\n");
+            return false;
+        }
+        if(lc->cmd == LC_SEGMENT_64 && img->nseg < hdr->ncmds)
+        {
+            mach_seg_t *seg = (mach_seg_t*)lc;
+            if(lc->cmdsize < sizeof(*seg) || seg->nsects > (lc->cmdsize - sizeof(*seg)) / sizeof(mach_sect_t))
+            {
+                fprintf(stderr, "Mach-O segment command too small.\n");
+                return false;
+            }
+            if(seg->fileoff == hdroff && seg->filesize != 0)
+            {
+                img->base = seg->vmaddr;
+            }
+            img->seg[img->nseg++] = seg;
+        }
+        else if(lc->cmd == LC_UUID && lc->cmdsize >= sizeof(mach_uuid_t))
+        {
+            memcpy(img->uuid, ((mach_uuid_t*)lc)->uuid, sizeof(img->uuid));
+        }
+        else if(lc->cmd == LC_DYLD_CHAINED_FIXUPS && lc->cmdsize >= sizeof(mach_data_t))
+        {
+            img->fixups = (mach_data_t*)lc;
+        }
+        else if(lc->cmd == LC_FUNCTION_STARTS && lc->cmdsize >= sizeof(mach_data_t))
+        {
+            img->fstarts = (mach_data_t*)lc;
+        }
+        else if(lc->cmd == LC_SYMTAB && lc->cmdsize >= sizeof(mach_symtab_t))
+        {
+            img->symtab = (mach_symtab_t*)lc;
+        }
+    }
+    return true;
+}
+
+// Finds the file data backing size bytes at addr, or NULL if they're not in the file.
+// Plain images use the file offset from their load commands, shared caches go by the mappings.
+static uint8_t* image_ptr(const image_t *img, uint64_t addr, uint64_t fileoff, uint64_t size)
+{
+    if(img->map)
+    {
+        for(uint32_t i = 0; i < img->nmap; ++i)
+        {
+            const cache_map_t *m = &img->map[i];
+            if(addr >= m->address && addr - m->address < m->size)
+            {
+                return size <= m->size - (addr - m->address) ? img->file + m->fileOffset + (addr - m->address) : NULL;
+            }
+        }
+        return NULL;
+    }
+    if(fileoff > img->filesize || size > img->filesize - fileoff)
+    {
+        return NULL;
+    }
+    return img->file + fileoff;
+}
+
+// Segments that are decoded in full rather than by section.
+static bool seg_whole(const mach_seg_t *seg, bool all)
+{
+    return all || (seg->nsects == 0 && (seg->initprot & VM_PROT_EXECUTE) != 0);
+}
+
+// Segments whose sections never hold anything of interest.
+static bool seg_skipped(const mach_seg_t *seg)
+{
+    return strncmp(seg->segname, "__LINKEDIT", sizeof(seg->segname)) == 0 || strncmp(seg->segname, "__PRELINK_INFO", sizeof(seg->segname)) == 0;
+}
+
+// Collects everything that holds code, i.e. sections flagged as containing instructions.
+// Segments without any sections are taken as a whole if they're executable.
+// With all, every segment is decoded in full instead. If data is given, it also
+// collects the sections that may hold pointers, and if strs is given, those that
+// may hold strings. Parts of a shared cache image that live in a different file
+// of a split cache are skipped, and counted in elsewhere.
+static bool image_sections(const image_t *img, bool all, ranges_t *code, datas_t *data, datas_t *strs, size_t *elsewhere)
+{
+    for(size_t i = 0; i < img->nseg; ++i)
+    {
+        mach_seg_t *seg = img->seg[i];
+        bool whole = seg_whole(seg, all);
+        if(whole)
+        {
+            uint32_t *p = (uint32_t*)image_ptr(img, seg->vmaddr, seg->fileoff, seg->filesize);
+            if(!p)
+            {
+                if(img->map)
+                {
+                    ++*elsewhere;
+                    continue;
+                }
+                fprintf(stderr, "Mach-O segment out of bounds.\n");
+                return false;
+            }
+            if(!grow(&code->r, &code->cap, code->num, sizeof(*code->r)))
+            {
+                return false;
+            }
+            code->r[code->num++] = (range_t){ .p = p, .e = p + (seg->filesize / 4), .addr = seg->vmaddr, .seg = seg->segname };
+            // Strings still go by section.
+            if(!strs)
+            {
+                continue;
+            }
+        }
+        else if(seg_skipped(seg))
+        {
+            continue;
+        }
+        mach_sect_t *sect = (mach_sect_t*)(seg + 1);
+        for(uint32_t j = 0; j < seg->nsects; ++j)
+        {
+            uint32_t type = sect[j].flags & SECTION_TYPE;
+            bool is_code = !whole && (sect[j].flags & (S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS)) != 0;
+            bool is_str = strs && (type == S_CSTRING_LITERALS || strncmp(sect[j].sectname, "__cstring", sizeof(sect[j].sectname)) == 0 || strncmp(sect[j].sectname, "__const", sizeof(sect[j].sectname)) == 0);
+            bool is_data = !is_code && !whole && data && type != S_CSTRING_LITERALS;
+            if(type == S_ZEROFILL || sect[j].size == 0 || (!is_code && !is_str && !is_data))
+            {
+                continue;
+            }
+            uint8_t *ptr = image_ptr(img, sect[j].addr, sect[j].offset, sect[j].size);
+            if(!ptr)
+            {
+                if(img->map)
+                {
+                    ++*elsewhere;
+                    continue;
+                }
+                fprintf(stderr, "Mach-O section out of bounds.\n");
+                return false;
+            }
+            if(is_code)
+            {
+                if(!grow(&code->r, &code->cap, code->num, sizeof(*code->r)))
+                {
+                    return false;
+                }
+                uint32_t *p = (uint32_t*)ptr;
+                code->r[code->num++] = (range_t){ .p = p, .e = p + (sect[j].size / 4), .addr = sect[j].addr, .seg = seg->segname };
+            }
+            if(is_str)
+            {
+                if(!grow(&strs->d, &strs->cap, strs->num, sizeof(*strs->d)))
+                {
+                    return false;
+                }
+                strs->d[strs->num++] = (data_t){ .p = ptr, .size = sect[j].size, .addr = sect[j].addr };
+            }
+            if(is_data)
+            {
+                if(!grow(&data->d, &data->cap, data->num, sizeof(*data->d)))
+                {
+                    return false;
+                }
+                data->d[data->num++] = (data_t){ .p = ptr, .size = sect[j].size, .addr = sect[j].addr };
+            }
+        }
+    }
+    return true;
+}
+
+// Whether n bytes are text: valid UTF-8, without control characters other than whitespace.
+static bool str_valid(const uint8_t *p, size_t n)
+{
+    for(size_t i = 0; i < n; )
+    {
+        uint8_t c = p[i];
+        if(c < 0x80)
+        {
+            if((c < 0x20 && c != '\t' && c != '\n' && c != '\r') || c == 0x7f)
+            {
+                return false;
+            }
+            ++i;
+            continue;
+        }
+        size_t len = c >= 0xc2 && c <= 0xdf ? 2 : c >= 0xe0 && c <= 0xef ? 3 : c >= 0xf0 && c <= 0xf4 ? 4 : 0;
+        if(len == 0 || len > n - i)
+        {
+            return false;
+        }
+        uint32_t cp = c & (0x7f >> len);
+        for(size_t j = 1; j < len; ++j)
+        {
+            if((p[i + j] & 0xc0) != 0x80)
+            {
+                return false;
+            }
+            cp = (cp << 6) | (p[i + j] & 0x3f);
+        }
+        // Overlong encodings, surrogates and anything past U+10FFFF
+        if((len == 3 && cp < 0x800) || (len == 4 && (cp < 0x10000 || cp > 0x10ffff)) || (cp >= 0xd800 && cp <= 0xdfff))
+        {
+            return false;
+        }
+        i += len;
+    }
+    return true;
+}
+
+// Finds every occurrence of needle in the string sections, and records the
+// whole string around it, since that's what code will reference. That's the
+// NUL-terminated run of bytes it's in, if all of it is text. Occurrences in
+// anything else, e.g. among the pointers in a __const section, are skipped.
+static bool strs_search(strs_t *str, const datas_t *sects, const char *needle)
+{
+    size_t len = strlen(needle);
+    bool found = false;
+    for(size_t i = 0; i < sects->num; ++i)
+    {
+        const uint8_t *base = sects->d[i].p;
+        size_t size = sects->d[i].size;
+        for(size_t off = 0; len <= size - off; )
+        {
+            const uint8_t *p = memchr(base + off, needle[0], size - off - len + 1);
+            if(!p)
+            {
+                break;
+            }
+            size_t at = p - base;
+            if(memcmp(p, needle, len) != 0)
+            {
+                off = at + 1;
+                continue;
+            }
+            size_t lo = at;
+            while(lo > 0 && base[lo - 1] != '\0')
+            {
+                --lo;
+            }
+            const uint8_t *nul = memchr(base + at + len, '\0', size - at - len);
+            size_t hi = nul ? (size_t)(nul - base) : size;
+            off = hi;
+            if(!nul || !str_valid(base + lo, hi - lo))
+            {
+                continue;
+            }
+            if(!grow(&str->s, &str->cap, str->num, sizeof(*str->s)))
+            {
+                return false;
+            }
+            str->s[str->num++] = (str_t){ .lo = sects->d[i].addr + lo, .hi = sects->d[i].addr + hi, .p = (const char*)base + lo };
+            found = true;
+        }
+    }
+    if(!found)
+    {
+        fprintf(stderr, "String not found: %s\n", needle);
+    }
+    return found;
+}
+
+static int strs_cmp(const void *a, const void *b)
+{
+    const str_t *x = a,
+                *y = b;
+    return x->lo < y->lo ? -1 : x->lo > y->lo ? 1 : 0;
+}
+
+// Sorts and dedups the strings found, and makes targets of them.
+static bool strs_targets(strs_t *str, targets_t *tg)
+{
+    qsort(str->s, str->num, sizeof(*str->s), strs_cmp);
+    size_t n = 0;
+    for(size_t i = 0; i < str->num; ++i)
+    {
+        if(n == 0 || str->s[n - 1].lo != str->s[i].lo)
+        {
+            str->s[n++] = str->s[i];
+            if(!targets_add(tg, str->s[i].lo, str->s[i].hi))
+            {
+                return false;
+            }
+        }
+    }
+    str->num = n;
+    targets_sort(tg);
+    return true;
+}
+
+static bool funcs_add(funcs_t *fn, uint64_t addr, const char *name)
+{
+    if(!grow(&fn->f, &fn->cap, fn->num, sizeof(*fn->f)))
+    {
+        return false;
+    }
+    fn->f[fn->num++] = (func_t){ .addr = addr, .name = name };
+    return true;
+}
+
+// By address, named ones first.
+static int funcs_cmp(const void *a, const void *b)
+{
+    const func_t *x = a,
+                 *y = b;
+    if(x->addr != y->addr) return x->addr < y->addr ? -1 : 1;
+    if(!x->name || !y->name) return x->name ? -1 : y->name ? 1 : 0;
+    return strcmp(x->name, y->name);
+}
+
+static int bounds_cmp(const void *a, const void *b)
+{
+    const uint64_t *x = a,
+                   *y = b;
+    return x[0] < y[0] ? -1 : x[0] > y[0] ? 1 : 0;
+}
+
+// Sorts and dedups the functions, and bounds each by the next one and the code range it's in,
+// so that neither the gap after the last one of a kext nor data count as part of them.
+// Functions that aren't in code at all, i.e. data symbols, are dropped.
+static bool funcs_sort(funcs_t *fn, const ranges_t *code)
+{
+    bool ok = false;
+    uint64_t (*bound)[2] = malloc((code->num ? code->num : 1) * sizeof(*bound));
+    if(!bound)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        goto out;
+    }
+    for(size_t i = 0; i < code->num; ++i)
+    {
+        bound[i][0] = code->r[i].addr;
+        bound[i][1] = code->r[i].addr + (uint64_t)(code->r[i].e - code->r[i].p) * 4;
+    }
+    qsort(bound, code->num, sizeof(*bound), bounds_cmp);
+    qsort(fn->f, fn->num, sizeof(*fn->f), funcs_cmp);
+    size_t n = 0;
+    for(size_t i = 0, j = 0; i < fn->num; ++i)
+    {
+        if(i + 1 < fn->num && fn->f[i + 1].addr == fn->f[i].addr)
+        {
+            // The named one comes first.
+            fn->f[i + 1] = fn->f[i];
+            continue;
+        }
+        func_t f = fn->f[i];
+        while(j < code->num && bound[j][1] <= f.addr)
+        {
+            ++j;
+        }
+        if(j == code->num || bound[j][0] > f.addr)
+        {
+            continue;
+        }
+        f.end = i + 1 < fn->num && fn->f[i + 1].addr < bound[j][1] ? fn->f[i + 1].addr : bound[j][1];
+        fn->f[n++] = f;
+    }
+    fn->num = n;
+    ok = true;
+out:;
+    if(bound) free(bound);
+    return ok;
+}
+
+// Collects the function starts of an image, and all symbols defined in its sections.
+// Tables that aren't in the file are skipped for shared cache images, like their sections.
+static bool image_funcs(const image_t *img, funcs_t *fn)
+{
+    const mach_data_t *fs = img->fstarts;
+    if(fs)
+    {
+        if(fs->dataoff > img->filesize || fs->datasize > img->filesize - fs->dataoff)
+        {
+            if(!img->map)
+            {
+                fprintf(stderr, "Function starts out of bounds.\n");
+                return false;
+            }
+        }
+        else
+        {
+            // ULEB128 deltas, the first one from the start of __TEXT, up to a zero.
+            const uint8_t *p = img->file + fs->dataoff,
+                          *e = p + fs->datasize;
+            uint64_t addr = img->base;
+            while(p < e)
+            {
+                uint64_t delta = 0;
+                for(uint32_t shift = 0; p < e; shift += 7)
+                {
+                    uint8_t b = *p++;
+                    if(shift < 64)
+                    {
+                        delta |= (uint64_t)(b & 0x7f) << shift;
+                    }
+                    if((b & 0x80) == 0)
+                    {
+                        break;
+                    }
+                }
+                if(delta == 0)
+                {
+                    break;
+                }
+                addr += delta;
+                if(!funcs_add(fn, addr, NULL))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    const mach_symtab_t *st = img->symtab;
+    if(st)
+    {
+        if(st->symoff > img->filesize || st->nsyms > (img->filesize - st->symoff) / sizeof(nlist_t) || st->stroff > img->filesize || st->strsize > img->filesize - st->stroff)
+        {
+            if(!img->map)
+            {
+                fprintf(stderr, "Symbol table out of bounds.\n");
+                return false;
+            }
+            return true;
+        }
+        const nlist_t *sym = (const nlist_t*)(img->file + st->symoff);
+        const char *str = (const char*)img->file + st->stroff;
+        for(uint32_t i = 0; i < st->nsyms; ++i)
+        {
+            uint32_t strx = sym[i].n_strx;
+            if((sym[i].n_type & N_STAB) != 0 || (sym[i].n_type & N_TYPE) != N_SECT || strx == 0 || strx >= st->strsize || !memchr(str + strx, '\0', st->strsize - strx))
+            {
+                continue;
+            }
+            if(!funcs_add(fn, sym[i].n_value, str + strx))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static int owners_cmp(const void *a, const void *b)
+{
+    const owner_t *x = a,
+                  *y = b;
+    return x->lo < y->lo ? -1 : x->lo > y->lo ? 1 : 0;
+}
+
+// Whether the named entry or image was asked for. Marks it as found if so.
+static bool entry_wanted(const char **names, size_t nnames, bool *found, const char *name)
+{
+    bool want = nnames == 0;
+    for(size_t i = 0; i < nnames; ++i)
+    {
+        if(strcmp(names[i], name) == 0)
+        {
+            found[i] = want = true;
+        }
+    }
+    return want;
+}
+
+// Collects code and data of one fileset entry or shared cache image, and records its address ranges.
+// Segments shared between images (i.e. __LINKEDIT) are collected once and don't count towards any image.
+static bool entry_sections(const image_t *img, mach_hdr_t *hdr, const char *name, bool all, ranges_t *code, datas_t *data, datas_t *strs, owners_t *own, funcs_t *fn, size_t *elsewhere)
+{
+    bool ok = false;
+    image_t sub = { 0 };
+    if(!image_parse(&sub, img->file, img->filesize, hdr))
+    {
+        goto out;
+    }
+    sub.map = img->map;
+    sub.nmap = img->nmap;
+    if(!image_sections(&sub, all, code, data, strs, elsewhere) || (fn && !image_funcs(&sub, fn)))
+    {
+        goto out;
+    }
+    for(size_t i = 0; i < sub.nseg; ++i)
+    {
+        const mach_seg_t *seg = sub.seg[i];
+        if(seg->vmsize == 0 || strncmp(seg->segname, "__LINKEDIT", sizeof(seg->segname)) == 0)
+        {
+            continue;
+        }
+        if(!grow(&own->o, &own->cap, own->num, sizeof(*own->o)))
+        {
+            goto out;
+        }
+        own->o[own->num++] = (owner_t){ .lo = seg->vmaddr, .hi = seg->vmaddr + seg->vmsize, .name = name };
+    }
+
+    ok = true;
+out:;
+    if(sub.seg) free(sub.seg);
+    return ok;
+}
+
+static int ranges_cmp(const void *a, const void *b)
+{
+    const range_t *x = *(const range_t* const*)a, *y = *(const range_t* const*)b;
+    if(x->p != y->p) return x->p < y->p ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+// With -a, segments shared between entries are collected with each of them, so drop all but the
+// first copy of each range, keeping them in order otherwise.
+static bool ranges_dedup(ranges_t *code)
+{
+    if(code->num < 2)
+    {
+        return true;
+    }
+    range_t **sorted = malloc(code->num * sizeof(*sorted));
+    if(!sorted)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        return false;
+    }
+    for(size_t i = 0; i < code->num; ++i)
+    {
+        sorted[i] = &code->r[i];
+    }
+    qsort(sorted, code->num, sizeof(*sorted), ranges_cmp);
+    for(size_t i = 1; i < code->num; ++i)
+    {
+        if(sorted[i]->p == sorted[i - 1]->p)
+        {
+            sorted[i]->e = NULL;
+        }
+    }
+    free(sorted);
+    size_t n = 0;
+    for(size_t i = 0; i < code->num; ++i)
+    {
+        if(code->r[i].e)
+        {
+            code->r[n++] = code->r[i];
+        }
+    }
+    code->num = n;
+    return true;
+}
+
+static bool entries_done(const char **names, size_t nnames, const bool *found, ranges_t *code, owners_t *own)
+{
+    for(size_t i = 0; i < nnames; ++i)
+    {
+        if(!found[i])
+        {
+            fprintf(stderr, "No entry or image named %s.\n", names[i]);
+            return false;
+        }
+    }
+    qsort(own->o, own->num, sizeof(*own->o), owners_cmp);
+    return ranges_dedup(code);
+}
+
+// Collects code and data of the entries of an MH_FILESET, in load command order.
+// If names are given, only those entries are taken.
+static bool fileset_sections(const image_t *img, bool all, const char **names, size_t nnames, ranges_t *code, datas_t *data, datas_t *strs, owners_t *own, funcs_t *fn)
+{
+    bool ok = false;
+    bool *found = calloc(nnames ? nnames : 1, sizeof(*found));
+    if(!found)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        goto out;
+    }
+    const mach_hdr_t *hdr = img->hdr;
+    for(const mach_lc_t *lc = (const mach_lc_t*)(hdr + 1), *end = (const mach_lc_t*)((uintptr_t)lc + hdr->sizeofcmds); lc < end; lc = (const mach_lc_t*)((uintptr_t)lc + lc->cmdsize))
+    {
+        if(lc->cmd != LC_FILESET_ENTRY)
+        {
+            continue;
+        }
+        const mach_fileset_t *ent = (const mach_fileset_t*)lc;
+        if(lc->cmdsize < sizeof(*ent) || ent->entry_id < sizeof(*ent) || ent->entry_id >= lc->cmdsize || !memchr((const char*)ent + ent->entry_id, '\0', lc->cmdsize - ent->entry_id))
+        {
+            fprintf(stderr, "Bad fileset entry command.\n");
+            goto out;
+        }
+        const char *name = (const char*)ent + ent->entry_id;
+        if(!entry_wanted(names, nnames, found, name))
+        {
+            continue;
+        }
+        if(ent->fileoff > img->filesize || img->filesize - ent->fileoff < sizeof(mach_hdr_t))
+        {
+            fprintf(stderr, "Fileset entry %s out of bounds.\n", name);
+            goto out;
+        }
+        if(!entry_sections(img, (mach_hdr_t*)(img->file + ent->fileoff), name, all, code, data, strs, own, fn, NULL))
+        {
+            goto out;
+        }
+    }
+    ok = entries_done(names, nnames, found, code, own);
+out:;
+    if(found) free(found);
+    return ok;
+}
+
+// Sets up a dyld_shared_cache and collects code and data of its images, in image table order.
+// Images whose header isn't in this file (i.e. in another file of a split cache) are skipped,
+// and so are their segments and sections that are elsewhere. Both are reported, since the scan
+// only covers part of the cache then. If names are given, only images with those paths are
+// taken, and they have to be in this file.
+static bool cache_sections(image_t *img, bool all, const char **names, size_t nnames, ranges_t *code, datas_t *data, datas_t *strs, owners_t *own, funcs_t *fn)
+{
+    bool ok = false;
+    bool *found = NULL;
+    const cache_hdr_t *hdr = (const cache_hdr_t*)img->file;
+    char magic[sizeof(hdr->magic) + 1] = { 0 };
+    memcpy(magic, hdr->magic, sizeof(hdr->magic));
+    const char *arch = magic + 7;
+    while(*arch == ' ') ++arch;
+    if(strcmp(arch, "arm64") != 0 && strcmp(arch, "arm64e") != 0)
+    {
+        fprintf(stderr, "Not an arm64 shared cache: %s\n", magic);
+        goto out;
+    }
+    if(hdr->mappingOffset > img->filesize || hdr->mappingCount > (img->filesize - hdr->mappingOffset) / sizeof(cache_map_t))
+    {
+        fprintf(stderr, "Shared cache mappings out of bounds.\n");
+        goto out;
+    }
+    img->map = (const cache_map_t*)(img->file + hdr->mappingOffset);
+    img->nmap = hdr->mappingCount;
+    for(uint32_t i = 0; i < img->nmap; ++i)
+    {
+        if(img->map[i].fileOffset > img->filesize || img->map[i].size > img->filesize - img->map[i].fileOffset)
+        {
+            fprintf(stderr, "Shared cache mapping %u out of bounds.\n", i);
+            goto out;
+        }
+    }
+    uint32_t imgoff = hdr->imagesOffset,
+             imgnum = hdr->imagesCount;
+    if(imgoff == 0 && hdr->mappingOffset >= CACHE_IMAGES_NEW + 2 * sizeof(uint32_t))
+    {
+        memcpy(&imgoff, img->file + CACHE_IMAGES_NEW, sizeof(imgoff));
+        memcpy(&imgnum, img->file + CACHE_IMAGES_NEW + sizeof(imgoff), sizeof(imgnum));
+    }
+    if(imgoff > img->filesize || imgnum > (img->filesize - imgoff) / sizeof(cache_img_t))
+    {
+        fprintf(stderr, "Shared cache images out of bounds.\n");
+        goto out;
+    }
+    memcpy(img->uuid, hdr->uuid, sizeof(img->uuid));
+
+    found = calloc(nnames ? nnames : 1, sizeof(*found));
+    if(!found)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        goto out;
+    }
+    const cache_img_t *ci = (const cache_img_t*)(img->file + imgoff);
+    size_t taken = 0, missing = 0, elsewhere = 0;
+    for(uint32_t i = 0; i < imgnum; ++i)
+    {
+        uint32_t off = ci[i].pathFileOffset;
+        if(off >= img->filesize || !memchr(img->file + off, '\0', img->filesize - off))
+        {
+            fprintf(stderr, "Shared cache image %u path out of bounds.\n", i);
+            goto out;
+        }
+        const char *name = (const char*)img->file + off;
+        if(!entry_wanted(names, nnames, found, name))
+        {
+            continue;
+        }
+        mach_hdr_t *mh = (mach_hdr_t*)image_ptr(img, ci[i].address, 0, sizeof(mach_hdr_t));
+        if(!mh)
+        {
+            if(nnames)
+            {
+                fprintf(stderr, "Image %s is in another file of the split cache.\n", name);
+                goto out;
+            }
+            ++missing;
+            continue;
+        }
+        if(!entry_sections(img, mh, name, all, code, data, strs, own, fn, &elsewhere))
+        {
+            goto out;
+        }
+        ++taken;
+    }
+    if(taken == 0 && missing != 0)
+    {
+        fprintf(stderr, "None of the %zu images are in this file of the split cache.\n", missing);
+        goto out;
+    }
+    if(missing != 0 || elsewhere != 0)
+    {
+        fprintf(stderr, "%zu of %u images and %zu segments or sections of the rest are in other files of the split cache, and weren't scanned.\n", missing, imgnum, elsewhere);
+    }
+    ok = entries_done(names, nnames, found, code, own);
+out:;
+    if(found) free(found);
+    return ok;
+}
+
+static bool image_contains(const image_t *img, uint64_t addr)
+{
+    for(size_t i = 0; i < img->nseg; ++i)
+    {
+        if(addr >= img->seg[i]->vmaddr && addr - img->seg[i]->vmaddr < img->seg[i]->vmsize)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ptr_hit(scan_t *sc, const image_t *img, uint64_t source, uint64_t target)
+{
+    // Don't fill the index with every data word that happens to not be a pointer
+    if(sc->refs && !image_contains(img, target))
+    {
+        return;
+    }
+    if(match(sc, source, target, Ref_Ptr))
+    {
+        hits_add(sc, source, target, Ref_Ptr);
+    }
+}
+
+// Walks all chained fixup chains and matches the rebase targets. Binds point outside the image and are skipped.
+static bool scan_fixups(scan_t *sc, const image_t *img)
+{
+    const mach_data_t *lc = img->fixups;
+    if(lc->dataoff > img->filesize || lc->datasize > img->filesize - lc->dataoff || lc->datasize < sizeof(fixups_hdr_t))
+    {
+        fprintf(stderr, "Chained fixups out of bounds.\n");
+        return false;
+    }
+    const uint8_t *buf = img->file + lc->dataoff;
+    const fixups_hdr_t *fh = (const fixups_hdr_t*)buf;
+    if(fh->fixups_version != 0)
+    {
+        fprintf(stderr, "Unsupported chained fixups version: %u\n", fh->fixups_version);
+        return false;
+    }
+    if(fh->starts_offset > lc->datasize - sizeof(fixups_image_t))
+    {
+        fprintf(stderr, "Chained fixups starts out of bounds.\n");
+        return false;
+    }
+    const fixups_image_t *fi = (const fixups_image_t*)(buf + fh->starts_offset);
+    size_t space = lc->datasize - fh->starts_offset;
+    if(fi->seg_count > (space - sizeof(*fi)) / sizeof(fi->seg_info_offset[0]))
+    {
+        fprintf(stderr, "Chained fixups segment info out of bounds.\n");
+        return false;
+    }
+    for(uint32_t i = 0; i < fi->seg_count && i < img->nseg; ++i)
+    {
+        uint32_t off = fi->seg_info_offset[i];
+        if(off == 0)
+        {
+            continue;
+        }
+        const fixups_seg_t *fs = (const fixups_seg_t*)((const uint8_t*)fi + off);
+        if(off > space - sizeof(*fs) || fs->page_count > (space - off - sizeof(*fs)) / sizeof(fs->page_start[0]))
+        {
+            fprintf(stderr, "Chained fixups segment starts out of bounds.\n");
+            return false;
+        }
+        uint32_t fmt = fs->pointer_format;
+        uint64_t stride;
+        switch(fmt)
+        {
+            case DYLD_CHAINED_PTR_ARM64E:
+            case DYLD_CHAINED_PTR_ARM64E_USERLAND:
+            case DYLD_CHAINED_PTR_ARM64E_USERLAND24:
+                stride = 8;
+                break;
+            case DYLD_CHAINED_PTR_ARM64E_KERNEL:
+            case DYLD_CHAINED_PTR_ARM64E_FIRMWARE:
+            case DYLD_CHAINED_PTR_64:
+            case DYLD_CHAINED_PTR_64_OFFSET:
+            case DYLD_CHAINED_PTR_64_KERNEL_CACHE:
+                stride = 4;
+                break;
+            default:
+                fprintf(stderr, "Unsupported chained pointer format %u, skipping segment %u.\n", fmt, i);
+                continue;
+        }
+        const mach_seg_t *seg = img->seg[i];
+        if(seg->fileoff > img->filesize || seg->filesize > img->filesize - seg->fileoff)
+        {
+            fprintf(stderr, "Mach-O segment out of bounds.\n");
+            return false;
+        }
+        const uint8_t *segdata = img->file + seg->fileoff;
+        for(uint32_t pg = 0; pg < fs->page_count; ++pg)
+        {
+            uint16_t start = fs->page_start[pg];
+            if(start == DYLD_CHAINED_PTR_START_NONE || (start & DYLD_CHAINED_PTR_START_MULTI) != 0)
+            {
+                continue;
+            }
+            // Chains don't cross pages, so those of entries that weren't selected needn't be touched.
+            if(img->own && !owners_overlap(img->own, seg->vmaddr + (uint64_t)pg * fs->page_size, fs->page_size))
+            {
+                continue;
+            }
+            for(uint64_t loc = (uint64_t)pg * fs->page_size + start; ; )
+            {
+                if(loc > seg->filesize || seg->filesize - loc < sizeof(uint64_t))
+                {
+                    fprintf(stderr, "Chained fixup out of bounds in segment %u.\n", i);
+                    return false;
+                }
+                uint64_t raw, next, target;
+                bool bind;
+                memcpy(&raw, segdata + loc, sizeof(raw));
+                if(fmt == DYLD_CHAINED_PTR_64 || fmt == DYLD_CHAINED_PTR_64_OFFSET)
+                {
+                    next   = (raw >> 51) & 0xfff;
+                    bind   = (raw >> 63) != 0;
+                    target = ((raw >> 36) & 0xff) << 56 | (raw & 0xfffffffffULL);
+                    if(fmt == DYLD_CHAINED_PTR_64_OFFSET) target += img->base;
+                }
+                else if(fmt == DYLD_CHAINED_PTR_64_KERNEL_CACHE)
+                {
+                    next   = (raw >> 51) & 0xfff;
+                    bind   = false;
+                    target = img->base + (raw & 0x3fffffff);
+                }
+                else
+                {
+                    next   = (raw >> 51) & 0x7ff;
+                    bind   = ((raw >> 62) & 0x1) != 0;
+                    if((raw >> 63) != 0) // auth
+                    {
+                        target = img->base + (raw & 0xffffffff);
+                    }
+                    else
+                    {
+                        target = ((raw >> 43) & 0xff) << 56 | (raw & 0x7ffffffffffULL);
+                        if(fmt != DYLD_CHAINED_PTR_ARM64E && fmt != DYLD_CHAINED_PTR_ARM64E_FIRMWARE) target += img->base;
+                    }
+                }
+                if(!bind)
+                {
+                    ptr_hit(sc, img, seg->vmaddr + loc, target);
+                }
+                if(next == 0)
+                {
+                    break;
+                }
+                loc += next * stride;
+            }
+        }
+    }
+    return true;
+}
+
+// Data pointer pass. With chained fixups, only fixup locations can hold pointers,
+// otherwise all aligned 8-byte words in data sections are taken as-is.
+static bool scan_ptrs(scan_t *sc, const image_t *img, const datas_t *data)
+{
+    if(img->fixups)
+    {
+        return scan_fixups(sc, img);
+    }
+    for(size_t i = 0; i < data->num; ++i)
+    {
+        const data_t *d = &data->d[i];
+        for(uint64_t off = (8 - (d->addr & 7)) & 7; off + 8 <= d->size; off += 8)
+        {
+            uint64_t val;
+            memcpy(&val, d->p + off, sizeof(val));
+            ptr_hit(sc, img, d->addr + off, val);
+        }
+    }
+    return true;
+}
+
+// Maps a Mach-O, fat binary or shared cache and collects everything to scan in it.
+// The image keeps pointing into in, so in must not move afterwards.
+static bool input_load(input_t *in, int fd, uint64_t size, bool all, bool ptrs, bool strings, bool want_fn, const char **names, size_t nnames)
+{
+    if(sizeof(mach_hdr_t) > size)
+    {
+        fprintf(stderr, "File too short to contain Mach-O header.\n");
+        return false;
+    }
+
+    void *mem = mmap(NULL, size, PROT_READ, MAP_FILE | MAP_PRIVATE, fd, 0);
+    if(mem == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        return false;
+    }
+    in->mem = mem;
+    in->size = size;
+    uint64_t filesize = size;
+
+    mach_hdr_t *hdr = mem;
+    fat_hdr_t *fat = mem;
+    bool cache = filesize >= sizeof(cache_hdr_t) && strncmp(((cache_hdr_t*)mem)->magic, "dyld_v1 ", 8) == 0;
+    if(cache && ptrs)
+    {
+        fprintf(stderr, "Pointers in shared caches are encoded by slide info, -d isn't supported.\n");
+        return false;
+    }
+    if(!cache && fat->magic == FAT_CIGAM)
+    {
+        if(sizeof(fat_arch_t) * SWAP32(fat->nfat_arch) > filesize - sizeof(mach_hdr_t))
+        {
+            fprintf(stderr, "File too short to contain fat header.\n");
+            return false;
+        }
+        bool found = false;
+        fat_arch_t *arch = (fat_arch_t*)(fat + 1);
+        for(size_t i = 0; i < SWAP32(fat->nfat_arch); ++i)
+        {
+            if(SWAP32(arch[i].cputype) == CPU_TYPE_ARM64)
+            {
+                uint32_t offset = SWAP32(arch[i].offset);
+                uint32_t newsize = SWAP32(arch[i].size);
+                if(offset > filesize || newsize > filesize - offset)
+                {
+                    fprintf(stderr, "Fat arch out of bounds.\n");
+                    return false;
+                }
+                if(newsize < sizeof(mach_hdr_t))
+                {
+                    fprintf(stderr, "Fat arch is too short to contain a Mach-O.\n");
+                    return false;
+                }
+                hdr = (mach_hdr_t*)((uintptr_t)hdr + offset);
+                filesize = newsize;
+                found = true;
+                break;
+            }
+        }
+        if(!found)
+        {
+            fprintf(stderr, "No arm64 slice in fat binary.\n");
+            return false;
+        }
+    }
+
+    image_t *img = &in->img;
+    datas_t *data = ptrs ? &in->data : NULL,
+            *strs = strings ? &in->strs : NULL;
+    funcs_t *fn = want_fn ? &in->fn : NULL;
+    if(cache)
+    {
+        img->file = mem;
+        img->filesize = filesize;
+        if(!cache_sections(img, all, names, nnames, &in->code, NULL, strs, &in->own, fn))
+        {
+            return false;
+        }
+        img->own = &in->own;
+    }
+    else if(!image_parse(img, (uint8_t*)hdr, filesize, hdr))
+    {
+        return false;
+    }
+    else if(hdr->filetype == MH_FILESET)
+    {
+        if(!fileset_sections(img, all, names, nnames, &in->code, data, strs, &in->own, fn))
+        {
+            return false;
+        }
+        img->own = &in->own;
+    }
+    else if(nnames)
+    {
+        fprintf(stderr, "Not a fileset or shared cache, -k doesn't apply.\n");
+        return false;
+    }
+    else if(!image_sections(img, all, &in->code, data, strs, NULL) || (fn && !image_funcs(img, fn)))
+    {
+        return false;
+    }
+    return funcs_sort(&in->fn, &in->code);
+}
+
+static void input_free(input_t *in)
+{
+    if(in->mem) munmap(in->mem, in->size);
+    if(in->img.seg) free(in->img.seg);
+    if(in->code.r) free(in->code.r);
+    if(in->data.d) free(in->data.d);
+    if(in->strs.d) free(in->strs.d);
+    if(in->own.o) free(in->own.o);
+    if(in->fn.f) free(in->fn.f);
+}
+
+// Whether the start of a file looks like something input_load() takes. Used to quietly
+// pass over everything else when searching directories. Fat files need an arm64 slice,
+// which also tells them apart from Java class files, which share their magic.
+static bool input_known(const uint8_t *head, size_t len)
+{
+    uint32_t magic = 0,
+             cputype = 0;
+    if(len >= 8)
+    {
+        memcpy(&magic, head, sizeof(magic));
+        memcpy(&cputype, head + 4, sizeof(cputype));
+    }
+    if(magic == FAT_CIGAM)
+    {
+        uint32_t nfat = SWAP32(cputype);
+        for(uint32_t i = 0; i < nfat && i < (len - sizeof(fat_hdr_t)) / sizeof(fat_arch_t); ++i)
+        {
+            fat_arch_t arch;
+            memcpy(&arch, head + sizeof(fat_hdr_t) + i * sizeof(arch), sizeof(arch));
+            if(SWAP32(arch.cputype) == CPU_TYPE_ARM64)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    return (magic == MH_MAGIC_64 && cputype == CPU_TYPE_ARM64) || (len >= 8 && memcmp(head, "dyld_v1 ", 8) == 0);
+}
+
+typedef struct
+{
+    char **path;
+    bool *found;        // Whether it came from a directory rather than the command line
+    size_t num;
+    size_t cap;
+    size_t capfound;
+} paths_t;
+
+static bool paths_add(paths_t *p, const char *path, bool found)
+{
+    if(!grow(&p->path, &p->cap, p->num, sizeof(*p->path)) || !grow(&p->found, &p->capfound, p->num, sizeof(*p->found)))
+    {
+        return false;
+    }
+    p->path[p->num] = strdup(path);
+    if(!p->path[p->num])
+    {
+        fprintf(stderr, "strdup: %s\n", strerror(errno));
+        return false;
+    }
+    p->found[p->num++] = found;
+    return true;
+}
+
+static int names_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+// Adds a file, or all files below a directory in name order. Symlinks to directories aren't followed.
+static bool paths_walk(paths_t *p, const char *path, bool found)
+{
+    bool ok = false;
+    DIR *dir = NULL;
+    char **ent = NULL;
+    size_t nent = 0,
+           capent = 0;
+    struct stat s;
+    if((found ? lstat(path, &s) : stat(path, &s)) != 0)
+    {
+        fprintf(stderr, "stat(%s): %s\n", path, strerror(errno));
+        goto out;
+    }
+    if(!S_ISDIR(s.st_mode))
+    {
+        // In directories, only regular files count, including through links.
+        bool skip = found && (S_ISLNK(s.st_mode) ? stat(path, &s) != 0 || !S_ISREG(s.st_mode) : !S_ISREG(s.st_mode));
+        ok = skip || paths_add(p, path, found);
+        goto out;
+    }
+    dir = opendir(path);
+    if(!dir)
+    {
+        fprintf(stderr, "opendir(%s): %s\n", path, strerror(errno));
+        goto out;
+    }
+    for(struct dirent *d; (d = readdir(dir)) != NULL; )
+    {
+        if(strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+        {
+            continue;
+        }
+        if(!grow(&ent, &capent, nent, sizeof(*ent)))
+        {
+            goto out;
+        }
+        size_t len = strlen(path);
+        ent[nent] = malloc(len + strlen(d->d_name) + 2);
+        if(!ent[nent])
+        {
+            fprintf(stderr, "malloc: %s\n", strerror(errno));
+            goto out;
+        }
+        sprintf(ent[nent++], len && path[len - 1] == '/' ? "%s%s" : "%s/%s", path, d->d_name);
+    }
+    qsort(ent, nent, sizeof(*ent), names_cmp);
+    for(size_t i = 0; i < nent; ++i)
+    {
+        if(!paths_walk(p, ent[i], true))
+        {
+            goto out;
+        }
+    }
+    ok = true;
+out:;
+    if(dir) closedir(dir);
+    for(size_t i = 0; i < nent; ++i)
+    {
+        free(ent[i]);
+    }
+    if(ent) free(ent);
+    return ok;
+}
+
+// Opens and loads every file in paths that can be scanned. Files found in directories
+// that aren't Mach-Os or shared caches are passed over quietly, anything else that fails
+// to load is reported and skipped, and makes the whole run count as failed.
+static bool inputs_load(input_t *in, size_t *nin, const paths_t *p, bool all, bool ptrs, bool want_fn)
+{
+    bool ok = true;
+    *nin = 0;
+    for(size_t i = 0; i < p->num; ++i)
+    {
+        const char *path = p->path[i];
+        int fd = open(path, O_RDONLY);
+        if(fd == -1)
+        {
+            fprintf(stderr, "open(%s): %s\n", path, strerror(errno));
+            ok = false;
+            continue;
+        }
+        struct stat s;
+        uint8_t head[0x1000];
+        ssize_t len = 0;
+        if(fstat(fd, &s) != 0 || !S_ISREG(s.st_mode) || (len = pread(fd, head, sizeof(head), 0)) < 0)
+        {
+            fprintf(stderr, "Not a regular file: %s\n", path);
+            ok = false;
+        }
+        else if(!input_known(head, len))
+        {
+            if(!p->found[i])
+            {
+                fprintf(stderr, "Not an arm64 Mach-O or shared cache: %s\n", path);
+                ok = false;
+            }
+        }
+        else
+        {
+            input_t *cur = &in[*nin];
+            memset(cur, 0, sizeof(*cur));
+            cur->path = path;
+            if(input_load(cur, fd, s.st_size, all, ptrs, false, want_fn, NULL, 0))
+            {
+                ++*nin;
+            }
+            else
+            {
+                fprintf(stderr, "Skipping %s.\n", path);
+                input_free(cur);
+                ok = false;
+            }
+        }
+        close(fd);
+    }
+    return ok;
+}
+
+// Chunks only partition the instructions that chains start at. Each chunk finishes its own
+// chains past its end, so nothing straddling a chunk boundary is lost or found twice.
+// Sequential scans use the same chunks, so that hits come out in the same order.
+#define CHUNK_WORDS 0x40000
+
+typedef struct
+{
+    const range_t *r;
+    size_t from;
+    size_t to;
+    hits_t hits;
+    refs_t refs;
+    uint64_t words;
+    uint64_t cands;
+    bool done;
+    bool fail;
+} chunk_t;
+
+// Worker threads, started once and then handed one batch of chunks after another,
+// so that a server doesn't start new ones for every query.
+typedef struct
+{
+    const targets_t *tg;
+    bool collect;
+    chunk_t *chunk;
+    size_t num;
+    size_t next;
+    size_t busy;        // Chunks being scanned right now
+    bool quit;
+    pthread_t *thr;
+    size_t nthr;
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Workers wait here for chunks
+    pthread_cond_t cond; // And signal here when one is done
+} pool_t;
+
+static void* pool_worker(void *arg)
+{
+    pool_t *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while(true)
+    {
+        while(!pool->quit && pool->next >= pool->num)
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if(pool->quit)
+        {
+            break;
+        }
+        chunk_t *c = &pool->chunk[pool->next++];
+        scan_t sc = { .tg = pool->tg, .refs = pool->collect ? &c->refs : NULL, .hits = &c->hits };
+        ++pool->busy;
+        pthread_mutex_unlock(&pool->lock);
+
+        scan_range(&sc, c->r, c->from, c->to);
+        c->words = sc.words;
+        c->cands = sc.cands;
+        c->fail = sc.fail;
+
+        pthread_mutex_lock(&pool->lock);
+        c->done = true;
+        --pool->busy;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static bool pool_start(pool_t *pool, size_t jobs)
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->thr = malloc(jobs * sizeof(*pool->thr));
+    if(!pool->thr)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        return false;
+    }
+    for(; pool->nthr < jobs; ++pool->nthr)
+    {
+        int r = pthread_create(&pool->thr[pool->nthr], NULL, pool_worker, pool);
+        if(r != 0)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(r));
+            return false;
+        }
+    }
+    return true;
+}
+
+// Also cleans up after a pool_start() that failed.
+static void pool_stop(pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for(size_t i = 0; i < pool->nthr; ++i)
+    {
+        pthread_join(pool->thr[i], NULL);
+    }
+    if(pool->thr) free(pool->thr);
+    pthread_cond_destroy(&pool->cond);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+// Sets up output for hits from in. With several files, they are grouped by file.
+static void out_input(out_t *o, const input_t *in, bool group)
+{
+    o->own = in->img.own;
+    o->fn = in->fn.num ? &in->fn : NULL;
+    o->path = group ? in->path : NULL;
+    o->pending = group;
+}
+
+// Scans the code of all inputs on the threads of pool, then their data if ptrs is set.
+// The chunks of all inputs go into one queue, so a single big file still keeps every
+// thread busy. Results are emitted strictly in chunk order, so the output is identical
+// to a sequential scan, one file after another. With group set, hits are grouped by file.
+static bool scan_parallel(scan_t *sc, out_t *o, const input_t *in, size_t nin, bool group, bool ptrs, pool_t *pool)
+{
+    bool ok = false;
+    size_t *first = NULL;
+    hits_t hits = { 0 };
+    refs_t *refs = sc->refs;
+    chunk_t *chunk = NULL;
+    size_t nchunk = 0;
+
+    size_t num = 0;
+    for(size_t k = 0; k < nin; ++k)
+    {
+        for(size_t i = 0; i < in[k].code.num; ++i)
+        {
+            num += ((size_t)(in[k].code.r[i].e - in[k].code.r[i].p) + CHUNK_WORDS - 1) / CHUNK_WORDS;
+        }
+    }
+    chunk = calloc(num ? num : 1, sizeof(*chunk));
+    first = malloc((nin + 1) * sizeof(*first));
+    if(!chunk || !first)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        goto out;
+    }
+    for(size_t k = 0; k < nin; ++k)
+    {
+        first[k] = nchunk;
+        const ranges_t *code = &in[k].code;
+        for(size_t i = 0; i < code->num; ++i)
+        {
+            for(size_t from = 0, n = code->r[i].e - code->r[i].p; from < n; from += CHUNK_WORDS)
+            {
+                chunk_t *c = &chunk[nchunk++];
+                c->r = &code->r[i];
+                c->from = from;
+                c->to = n - from > CHUNK_WORDS ? from + CHUNK_WORDS : n;
+            }
+        }
+    }
+    first[nin] = nchunk;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->tg = sc->tg;
+    pool->collect = refs != NULL;
+    pool->chunk = chunk;
+    pool->num = nchunk;
+    pool->next = 0;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(size_t k = 0; k < nin; ++k)
+    {
+        out_input(o, &in[k], group);
+        for(size_t i = first[k]; i < first[k + 1]; ++i)
+        {
+            chunk_t *c = &chunk[i];
+            pthread_mutex_lock(&pool->lock);
+            while(!c->done)
+            {
+                pthread_cond_wait(&pool->cond, &pool->lock);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            if(c->fail)
+            {
+                goto out;
+            }
+            sc->words += c->words;
+            sc->cands += c->cands;
+            out_hits(o, &c->hits);
+            if(o->fail)
+            {
+                goto out;
+            }
+            free(c->hits.hit);
+            c->hits.hit = NULL;
+            if(refs)
+            {
+                for(size_t j = 0; j < c->refs.num; ++j)
+                {
+                    const ref_t *ref = &c->refs.ref[j];
+                    if(!refs_add(refs, ref->source, ref->target, ref->kind))
+                    {
+                        goto out;
+                    }
+                }
+                free(c->refs.ref);
+                c->refs.ref = NULL;
+            }
+        }
+        // The threads carry on with the next file meanwhile.
+        if(ptrs)
+        {
+            scan_t ps = { .tg = sc->tg, .refs = refs, .hits = &hits };
+            if(!scan_ptrs(&ps, &in[k].img, &in[k].data) || ps.fail)
+            {
+                goto out;
+            }
+            out_hits(o, &hits);
+            if(o->fail)
+            {
+                goto out;
+            }
+        }
+    }
+
+    ok = true;
+out:;
+    // Whatever is left is dropped, but chunks being scanned are waited for.
+    pthread_mutex_lock(&pool->lock);
+    pool->next = pool->num;
+    while(pool->busy)
+    {
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    pool->chunk = NULL;
+    pool->num = pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+    if(chunk)
+    {
+        for(size_t i = 0; i < nchunk; ++i)
+        {
+            if(chunk[i].hits.hit) free(chunk[i].hits.hit);
+            if(chunk[i].refs.ref) free(chunk[i].refs.ref);
+        }
+        free(chunk);
+    }
+    if(first) free(first);
+    if(hits.hit) free(hits.hit);
+    return ok;
+}
+
+// Streaming input, for pipes and the like: the load commands are read first, then the code
+// in file order, a chunk at a time. The tracker is carried from one chunk to the next.
+#define STREAM_SIZE (4 * CHUNK_WORDS)
+
+// Code is read in file order, but its hits go out in load command order, as with a file.
+// Hits of extents read before their turn are held until then.
+typedef struct
+{
+    uint64_t off;
+    uint64_t size;
+    uint64_t addr;
+    size_t seq;     // Position in load command order
+    bool done;
+    hits_t hits;    // Held hits
+} extent_t;
+
+typedef struct
+{
+    extent_t *x;
+    size_t num;
+    size_t cap;
+} extents_t;
+
+static bool extents_add(extents_t *x, uint64_t off, uint64_t size, uint64_t addr)
+{
+    if(!grow(&x->x, &x->cap, x->num, sizeof(*x->x)))
+    {
+        return false;
+    }
+    x->x[x->num] = (extent_t){ .off = off, .size = size, .addr = addr, .seq = x->num };
+    ++x->num;
+    return true;
+}
+
+static int extents_cmp(const void *a, const void *b)
+{
+    const extent_t *x = a,
+                   *y = b;
+    return x->off < y->off ? -1 : x->off > y->off ? 1 : 0;
+}
+
+// Reads exactly n bytes.
+static bool stream_read(int fd, void *buf, uint64_t n, uint64_t *pos)
+{
+    for(uint64_t got = 0; got < n; )
+    {
+        ssize_t r = read(fd, (uint8_t*)buf + got, n - got);
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "read: %s\n", strerror(errno));
+            return false;
+        }
+        if(r == 0)
+        {
+            fprintf(stderr, "Unexpected end of input.\n");
+            return false;
+        }
+        got += r;
+        *pos += r;
+    }
+    return true;
+}
+
+// Throws away input up to off, or up to the end if off is UINT64_MAX.
+static bool stream_skip(int fd, uint8_t *buf, uint64_t *pos, uint64_t off)
+{
+    while(*pos < off)
+    {
+        ssize_t r = read(fd, buf, off - *pos < STREAM_SIZE ? off - *pos : STREAM_SIZE);
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "read: %s\n", strerror(errno));
+            return false;
+        }
+        if(r == 0)
+        {
+            if(off == UINT64_MAX)
+            {
+                break;
+            }
+            fprintf(stderr, "Unexpected end of input.\n");
+            return false;
+        }
+        *pos += r;
+    }
+    return true;
+}
+
+// Prints the held hits of extents whose turn has come, up to the first that isn't done yet.
+static void extents_out(out_t *o, extent_t **order, size_t num, size_t *next)
+{
+    for(; *next < num && order[*next]->done; ++*next)
+    {
+        out_hits(o, &order[*next]->hits);
+        if(order[*next]->hits.hit)
+        {
+            free(order[*next]->hits.hit);
+            order[*next]->hits = (hits_t){ 0 };
+        }
+    }
+}
+
+// Scans a thin or fat Mach-O from fd without seeking. Memory use only depends on the size
+// of the load commands, and the hits of code that comes before its turn in them.
+// The input is read to the end, its size and UUID are returned for the index.
+static bool scan_stream(scan_t *sc, out_t *o, int fd, bool all, uint8_t *uuid, uint64_t *size)
+{
+    bool ok = false;
+    uint8_t *buf = NULL,
+            *cmds = NULL;
+    fat_arch_t *arch = NULL;
+    image_t img = { 0 };
+    extents_t ext = { 0 };
+    extent_t **order = NULL;
+    hits_t *own = sc->hits;
+    size_t next = 0;
+    uint64_t pos = 0,
+             base = 0;
+
+    buf = malloc(STREAM_SIZE);
+    if(!buf)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        goto out;
+    }
+    mach_hdr_t hdr;
+    fat_hdr_t *fat = (fat_hdr_t*)&hdr;
+    if(!stream_read(fd, fat, sizeof(*fat), &pos))
+    {
+        goto out;
+    }
+    if(fat->magic == FAT_CIGAM)
+    {
+        uint32_t nfat = SWAP32(fat->nfat_arch);
+        if(nfat > STREAM_SIZE / sizeof(*arch))
+        {
+            fprintf(stderr, "Too many fat archs.\n");
+            goto out;
+        }
+        arch = malloc((nfat ? nfat : 1) * sizeof(*arch));
+        if(!arch)
+        {
+            fprintf(stderr, "malloc: %s\n", strerror(errno));
+            goto out;
+        }
+        if(!stream_read(fd, arch, nfat * sizeof(*arch), &pos))
+        {
+            goto out;
+        }
+        bool found = false;
+        for(uint32_t i = 0; i < nfat; ++i)
+        {
+            if(SWAP32(arch[i].cputype) == CPU_TYPE_ARM64)
+            {
+                base = SWAP32(arch[i].offset);
+                found = true;
+                break;
+            }
+        }
+        if(!found)
+        {
+            fprintf(stderr, "No arm64 slice in fat binary.\n");
+            goto out;
+        }
+        if(base < pos)
+        {
+            fprintf(stderr, "Fat arch out of bounds.\n");
+            goto out;
+        }
+        if(!stream_skip(fd, buf, &pos, base) || !stream_read(fd, &hdr, sizeof(hdr), &pos))
+        {
+            goto out;
+        }
+    }
+    else if(!stream_read(fd, (uint8_t*)&hdr + sizeof(*fat), sizeof(hdr) - sizeof(*fat), &pos))
+    {
+        goto out;
+    }
+    if(hdr.magic != MH_MAGIC_64)
+    {
+        fprintf(stderr, "Not a 64-bit Mach-O.\n");
+        goto out;
+    }
+    // Entries' headers are spread over the file, so which entry a hit is in can't be
+    // known in one pass. Rather than scanning it as one image, with hits lacking the
+    // entry tags they'd get from the file, refuse.
+    if(hdr.filetype == MH_FILESET)
+    {
+        fprintf(stderr, "Input isn't a regular file, but filesets need one.\n");
+        goto out;
+    }
+    cmds = malloc(sizeof(hdr) + hdr.sizeofcmds);
+    if(!cmds)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        goto out;
+    }
+    memcpy(cmds, &hdr, sizeof(hdr));
+    if(!stream_read(fd, cmds + sizeof(hdr), hdr.sizeofcmds, &pos))
+    {
+        goto out;
+    }
+    if(!image_parse(&img, cmds, sizeof(hdr) + hdr.sizeofcmds, (mach_hdr_t*)cmds))
+    {
+        goto out;
+    }
+    memcpy(uuid, img.uuid, sizeof(img.uuid));
+
+    for(size_t i = 0; i < img.nseg; ++i)
+    {
+        const mach_seg_t *seg = img.seg[i];
+        if(seg_whole(seg, all))
+        {
+            if(!extents_add(&ext, seg->fileoff, seg->filesize, seg->vmaddr))
+            {
+                goto out;
+            }
+            continue;
+        }
+        if(seg_skipped(seg))
+        {
+            continue;
+        }
+        const mach_sect_t *sect = (const mach_sect_t*)(seg + 1);
+        for(uint32_t j = 0; j < seg->nsects; ++j)
+        {
+            if((sect[j].flags & SECTION_TYPE) == S_ZEROFILL || sect[j].size == 0 || (sect[j].flags & (S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS)) == 0)
+            {
+                continue;
+            }
+            if(!extents_add(&ext, sect[j].offset, sect[j].size, sect[j].addr))
+            {
+                goto out;
+            }
+        }
+    }
+    qsort(ext.x, ext.num, sizeof(*ext.x), extents_cmp);
+    order = malloc((ext.num ? ext.num : 1) * sizeof(*order));
+    if(!order)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        goto out;
+    }
+    for(size_t i = 0; i < ext.num; ++i)
+    {
+        order[ext.x[i].seq] = &ext.x[i];
+    }
+
+    for(size_t i = 0; i < ext.num; ++i)
+    {
+        // Whatever overlaps with what was already read is dropped.
+        uint64_t off  = base + ext.x[i].off,
+                 len  = ext.x[i].size,
+                 addr = ext.x[i].addr;
+        bool live = ext.x[i].seq == next;
+        sc->hits = live ? own : &ext.x[i].hits;
+        if(off < pos)
+        {
+            uint64_t skip = (pos - off + 3) & ~3ULL;
+            if(skip >= len)
+            {
+                len = 0;
+            }
+            else
+            {
+                off  += skip;
+                len  -= skip;
+                addr += skip;
+            }
+        }
+        if(len && !stream_skip(fd, buf, &pos, off))
+        {
+            goto out;
+        }
+        tracker_t tr;
+        tr.live = 0;
+        for(uint64_t left = len / 4; left > 0; )
+        {
+            size_t n = left < STREAM_SIZE / 4 ? left : STREAM_SIZE / 4;
+            if(!stream_read(fd, buf, 4 * n, &pos))
+            {
+                goto out;
+            }
+            scan_words(sc, &tr, (const uint32_t*)buf, n, addr);
+            if(live)
+            {
+                out_hits(o, sc->hits);
+            }
+            addr += 4 * n;
+            left -= n;
+        }
+        sc->hits = own;
+        ext.x[i].done = true;
+        extents_out(o, order, ext.num, &next);
+    }
+    if(!stream_skip(fd, buf, &pos, UINT64_MAX))
+    {
+        goto out;
+    }
+    *size = pos;
+
+    ok = true;
+out:;
+    sc->hits = own;
+    if(ext.x)
+    {
+        for(size_t i = 0; i < ext.num; ++i)
+        {
+            if(ext.x[i].hits.hit) free(ext.x[i].hits.hit);
+        }
+        free(ext.x);
+    }
+    if(order) free(order);
+    if(img.seg) free(img.seg);
+    if(cmds) free(cmds);
+    if(arch) free(arch);
+    if(buf) free(buf);
+    return ok;
+}
+
+// Hashes a piece of code, to tell whether it changed between builds.
+static uint64_t page_hash(const uint32_t *p, size_t n)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+    size_t i = 0;
+    for(; i + 1 < n; i += 2)
+    {
+        h = (h ^ (p[i] | (uint64_t)p[i + 1] << 32)) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    if(i < n)
+    {
+        h = (h ^ p[i]) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+// End of the piece of r that starts at word from.
+static size_t page_end(const range_t *r, size_t from)
+{
+    size_t n  = r->e - r->p,
+           to = from + (IDX_PAGE - ((r->addr + from * 4) & (IDX_PAGE - 1)) + 3) / 4;
+    return to < n ? to : n;
+}
+
+static idx_page_t page_make(const range_t *r, size_t from, size_t to)
+{
+    return (idx_page_t)
+    {
+        .addr  = r->addr + from * 4,
+        .size  = (to - from) * 4,
+        .flags = to == (size_t)(r->e - r->p) ? IDX_PAGE_LAST : 0,
+        .hash  = page_hash(r->p + from, to - from),
+    };
+}
+
+static int pages_cmp(const void *a, const void *b)
+{
+    const idx_page_t *x = a,
+                     *y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr ? 1 : 0;
+}
+
+// Hashes all of code, sorted by address.
+static idx_page_t* pages_make(const ranges_t *code, size_t *num)
+{
+    size_t npage = 0;
+    for(size_t i = 0; i < code->num; ++i)
+    {
+        for(size_t from = 0, n = code->r[i].e - code->r[i].p; from < n; from = page_end(&code->r[i], from))
+        {
+            ++npage;
+        }
+    }
+    idx_page_t *page = malloc((npage ? npage : 1) * sizeof(*page));
+    if(!page)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+    npage = 0;
+    for(size_t i = 0; i < code->num; ++i)
+    {
+        const range_t *r = &code->r[i];
+        for(size_t from = 0, n = r->e - r->p, to; from < n; from = to)
+        {
+            to = page_end(r, from);
+            page[npage++] = page_make(r, from, to);
+        }
+    }
+    qsort(page, npage, sizeof(*page), pages_cmp);
+    *num = npage;
+    return page;
+}
+
+// The one piece in page that overlaps pg, or NULL if there's none or more than one.
+// Pieces don't cross IDX_PAGE boundaries, so only those in the same one have to be looked at.
+static const idx_page_t* page_only(const idx_page_t *page, size_t npage, const idx_page_t *pg)
+{
+    uint64_t base = pg->addr & ~(uint64_t)(IDX_PAGE - 1);
+    size_t lo = 0,
+           hi = npage;
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(page[mid].addr < base)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    const idx_page_t *found = NULL;
+    for(; lo < npage && page[lo].addr < pg->addr + pg->size; ++lo)
+    {
+        if(page[lo].addr + page[lo].size > pg->addr)
+        {
+            if(found)
+            {
+                return NULL;
+            }
+            found = &page[lo];
+        }
+    }
+    return found;
+}
+
+static bool index_write(const char *path, refs_t *refs, const ranges_t *code, const uint8_t *uuid, uint64_t filesize)
+{
+    bool ok = false;
+    uint64_t *buf = NULL;
+    idx_page_t *page = NULL;
+    FILE *f = NULL;
+
+    size_t npage = 0;
+    page = pages_make(code, &npage);
+    if(!page)
+    {
+        goto out;
+    }
+
+    // Updated indexes are sorted already.
+    size_t sorted = 1;
+    while(sorted < refs->num && refs_cmp(&refs->ref[sorted - 1], &refs->ref[sorted]) <= 0)
+    {
+        ++sorted;
+    }
+    if(sorted < refs->num)
+    {
+        qsort(refs->ref, refs->num, sizeof(*refs->ref), refs_cmp);
+    }
+    buf = calloc(refs->num + 1, sizeof(*buf));
+    if(!buf)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        goto out;
+    }
+    f = fopen(path, "wb");
+    if(!f)
+    {
+        fprintf(stderr, "fopen(%s): %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    idx_hdr_t hdr = { .magic = IDX_MAGIC, .version = IDX_VERSION, .filesize = filesize, .num = refs->num, .npage = npage };
+    memcpy(hdr.uuid, uuid, sizeof(hdr.uuid));
+    if(fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+    {
+        goto err;
+    }
+    for(size_t i = 0; i < refs->num; ++i) buf[i] = refs->ref[i].target;
+    if(fwrite(buf, sizeof(*buf), refs->num, f) != refs->num)
+    {
+        goto err;
+    }
+    for(size_t i = 0; i < refs->num; ++i) buf[i] = refs->ref[i].source;
+    if(fwrite(buf, sizeof(*buf), refs->num, f) != refs->num)
+    {
+        goto err;
+    }
+    // Zeroed up to the padding, which buf has room for.
+    size_t nkind = (refs->num + 7) & ~(size_t)7;
+    uint8_t *kind = (uint8_t*)buf;
+    memset(kind, 0, nkind);
+    for(size_t i = 0; i < refs->num; ++i) kind[i] = refs->ref[i].kind;
+    if(fwrite(kind, sizeof(*kind), nkind, f) != nkind)
+    {
+        goto err;
+    }
+    if(fwrite(page, sizeof(*page), npage, f) != npage)
+    {
+        goto err;
+    }
+    if(fflush(f) != 0)
+    {
+        goto err;
+    }
+
+    ok = true;
+    goto out;
+err:;
+    fprintf(stderr, "fwrite(%s): %s\n", path, strerror(errno));
+out:;
+    if(f) fclose(f);
+    if(buf) free(buf);
+    if(page) free(page);
+    return ok;
+}
+
+static bool graph_write(const char *path, refs_t *refs, const uint8_t *uuid, uint64_t filesize)
+{
+    bool ok = false;
+    uint64_t *buf = NULL;
+    FILE *f = NULL;
+
+    qsort(refs->ref, refs->num, sizeof(*refs->ref), edges_cmp);
+    size_t nedge = 0,
+           nsrc  = 0;
+    for(size_t i = 0; i < refs->num; ++i)
+    {
+        if(nedge > 0 && edges_cmp(&refs->ref[nedge - 1], &refs->ref[i]) == 0)
+        {
+            continue;
+        }
+        if(nedge == 0 || refs->ref[nedge - 1].source != refs->ref[i].source)
+        {
+            ++nsrc;
+        }
+        refs->ref[nedge++] = refs->ref[i];
+    }
+    refs->num = nedge;
+
+    buf = malloc((nedge > nsrc ? nedge : nsrc + 1) * sizeof(*buf));
+    if(!buf)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        goto out;
+    }
+    f = fopen(path, "wb");
+    if(!f)
+    {
+        fprintf(stderr, "fopen(%s): %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    graph_hdr_t hdr = { .magic = GRAPH_MAGIC, .version = GRAPH_VERSION, .filesize = filesize, .nsrc = nsrc, .nedge = nedge };
+    memcpy(hdr.uuid, uuid, sizeof(hdr.uuid));
+    if(fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+    {
+        goto err;
+    }
+    size_t n = 0;
+    for(size_t i = 0; i < nedge; ++i)
+    {
+        if(i == 0 || refs->ref[i - 1].source != refs->ref[i].source) buf[n++] = refs->ref[i].source;
+    }
+    if(fwrite(buf, sizeof(*buf), nsrc, f) != nsrc)
+    {
+        goto err;
+    }
+    n = 0;
+    for(size_t i = 0; i < nedge; ++i)
+    {
+        if(i == 0 || refs->ref[i - 1].source != refs->ref[i].source) buf[n++] = i;
+    }
+    buf[n++] = nedge;
+    if(fwrite(buf, sizeof(*buf), nsrc + 1, f) != nsrc + 1)
+    {
+        goto err;
+    }
+    for(size_t i = 0; i < nedge; ++i) buf[i] = refs->ref[i].target;
+    if(fwrite(buf, sizeof(*buf), nedge, f) != nedge)
+    {
+        goto err;
+    }
+    uint8_t *kind = (uint8_t*)buf;
+    for(size_t i = 0; i < nedge; ++i) kind[i] = refs->ref[i].kind;
+    if(fwrite(kind, sizeof(*kind), nedge, f) != nedge)
+    {
+        goto err;
+    }
+    if(fflush(f) != 0)
+    {
+        goto err;
+    }
+
+    ok = true;
+    goto out;
+err:;
+    fprintf(stderr, "fwrite(%s): %s\n", path, strerror(errno));
+out:;
+    if(f) fclose(f);
+    if(buf) free(buf);
+    return ok;
+}
+
+// A mapped index.
+typedef struct
+{
+    int fd;
+    void *mem;
+    size_t len;
+    const idx_hdr_t *hdr;
+    const uint64_t *target;
+    const uint64_t *source;
+    const uint8_t *kind;
+    const idx_page_t *page;
+} index_t;
+
+static void index_close(index_t *idx)
+{
+    if(idx->mem != MAP_FAILED) munmap(idx->mem, idx->len);
+    if(idx->fd != -1) close(idx->fd);
+}
+
+// Maps and checks an index. idx has to be closed even if this fails.
+static bool index_open(const char *path, index_t *idx)
+{
+    idx->fd = open(path, O_RDONLY);
+    idx->mem = MAP_FAILED;
+    if(idx->fd == -1)
+    {
+        fprintf(stderr, "open(%s): %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat s;
+    if(fstat(idx->fd, &s) != 0)
+    {
+        fprintf(stderr, "fstat(%s): %s\n", path, strerror(errno));
+        return false;
+    }
+    idx->len = s.st_size;
+    if(idx->len < sizeof(idx_hdr_t))
+    {
+        fprintf(stderr, "Index too short to contain header.\n");
+        return false;
+    }
+    idx->mem = mmap(NULL, idx->len, PROT_READ, MAP_FILE | MAP_PRIVATE, idx->fd, 0);
+    if(idx->mem == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap(%s): %s\n", path, strerror(errno));
+        return false;
+    }
+    const idx_hdr_t *hdr = idx->mem;
+    if(memcmp(hdr->magic, IDX_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != IDX_VERSION)
+    {
+        fprintf(stderr, "Not an xref index, or wrong version.\n");
+        return false;
+    }
+    uint64_t left = idx->len - sizeof(*hdr),
+             used = 0;
+    if(hdr->num <= left / (2 * sizeof(uint64_t) + sizeof(uint8_t)))
+    {
+        used = 2 * sizeof(uint64_t) * hdr->num + ((hdr->num + 7) & ~7ull);
+    }
+    if(hdr->num > left / (2 * sizeof(uint64_t) + sizeof(uint8_t)) || used > left || hdr->npage > (left - used) / sizeof(idx_page_t))
+    {
+        fprintf(stderr, "Index too short to contain entries.\n");
+        return false;
+    }
+    idx->hdr    = hdr;
+    idx->target = (const uint64_t*)(hdr + 1);
+    idx->source = idx->target + hdr->num;
+    idx->kind   = (const uint8_t*)(idx->source + hdr->num);
+    idx->page   = (const idx_page_t*)(idx->kind + ((hdr->num + 7) & ~7ull));
+    return true;
+}
+
+// Whether an index was made from this file.
+static bool index_current(const index_t *idx, const uint8_t *uuid, uint64_t filesize)
+{
+    if(memcmp(idx->hdr->uuid, uuid, sizeof(idx->hdr->uuid)) != 0 || idx->hdr->filesize != filesize)
+    {
+        fprintf(stderr, "Index is stale (UUID or file size mismatch).\n");
+        return false;
+    }
+    return true;
+}
+
+// Looks up all sources referencing the targets, then re-runs the tracker on just those instructions to print them.
+static bool index_query(const index_t *idx, scan_t *sc, const ranges_t *code)
+{
+    bool ok = false;
+    ref_t *src = NULL;
+    size_t nsrc = 0;
+    const targets_t *tg = sc->tg;
+
+    const idx_hdr_t *hdr = idx->hdr;
+    const uint64_t *target = idx->target,
+                   *source = idx->source;
+    const uint8_t *kind = idx->kind;
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        for(size_t i = 0; i < tg->num; ++i)
+        {
+            for(size_t j = lower_bound(target, hdr->num, tg->span[i].lo); j < hdr->num && target[j] < tg->span[i].hi; ++j)
+            {
+                if(src) src[nsrc] = (ref_t){ .target = target[j], .source = source[j], .kind = kind[j] };
+                ++nsrc;
+            }
+        }
+        if(pass == 0)
+        {
+            src = malloc((nsrc ? nsrc : 1) * sizeof(*src));
+            if(!src)
+            {
+                fprintf(stderr, "malloc: %s\n", strerror(errno));
+                goto out;
+            }
+            nsrc = 0;
+        }
+    }
+    if(nsrc) qsort(src, nsrc, sizeof(*src), edges_cmp);
+    // Overlapping ranges find the same entries more than once.
+    size_t n = 0;
+    for(size_t i = 0; i < nsrc; ++i)
+    {
+        if(n == 0 || edges_cmp(&src[n - 1], &src[i]) != 0)
+        {
+            src[n++] = src[i];
+        }
+    }
+    nsrc = n;
+    // Same order as a scan: code first, then data pointers.
+    for(size_t i = 0, last = 0; i < nsrc; ++i)
+    {
+        if(src[i].kind == Ref_Ptr || (last != 0 && src[last - 1].source == src[i].source))
+        {
+            continue;
+        }
+        last = i + 1;
+        for(size_t j = 0; j < code->num; ++j)
+        {
+            const range_t *r = &code->r[j];
+            if(src[i].source >= r->addr && (src[i].source - r->addr) / 4 < (size_t)(r->e - r->p))
+            {
+                size_t idx = (src[i].source - r->addr) / 4;
+                scan_range(sc, r, idx, idx + 1);
+                break;
+            }
+        }
+    }
+    for(size_t i = 0; i < nsrc; ++i)
+    {
+        if(src[i].kind == Ref_Ptr && match(sc, src[i].source, src[i].target, Ref_Ptr))
+        {
+            hits_add(sc, src[i].source, src[i].target, Ref_Ptr);
+        }
+    }
+
+    ok = true;
+out:;
+    if(src) free(src);
+    return ok;
+}
+
+// Collects the references of a new build from the index of an old one. Pieces of code that are
+// unchanged keep their references, only the others are scanned again. Chains can reach from one
+// piece into the next, so scanning starts back at the last instruction before a changed piece
+// that ends all of them. Code in more than one range, now or in the old build, is always scanned,
+// since its references can't be told apart by range. Data pointers are quick to find, so they're
+// never taken over. The result is in index order already.
+static bool index_update(const char *path, scan_t *sc, const input_t *in, bool ptrs)
+{
+    bool ok = false;
+    index_t idx;
+    idx_page_t *page = NULL;
+    targets_t keep = { 0 }; // Code whose references are taken over
+    refs_t fresh = { 0 };
+    scan_t fs = { .tg = sc->tg, .refs = &fresh, .hits = sc->hits };
+
+    if(!index_open(path, &idx))
+    {
+        goto out;
+    }
+    const idx_hdr_t *hdr = idx.hdr;
+    size_t npage = 0;
+    page = pages_make(&in->code, &npage);
+    if(!page)
+    {
+        goto out;
+    }
+    for(size_t i = 0; i < in->code.num; ++i)
+    {
+        const range_t *r = &in->code.r[i];
+        // Everything before done has been scanned or is kept.
+        size_t n = r->e - r->p,
+               done = 0;
+        for(size_t from = 0, to; from < n; from = to)
+        {
+            to = page_end(r, from);
+            idx_page_t pg = { .addr = r->addr + from * 4, .size = (to - from) * 4 };
+            const idx_page_t *cur = page_only(page, npage, &pg),
+                             *old = page_only(idx.page, hdr->npage, &pg);
+            if(cur && old && old->addr == cur->addr && old->size == cur->size && old->flags == cur->flags && old->hash == cur->hash)
+            {
+                continue;
+            }
+            size_t start = from;
+            while(start > done && clobbers(r->p[start - 1]) != ~0u)
+            {
+                --start;
+            }
+            if(start > done && !targets_add(&keep, r->addr + done * 4, r->addr + start * 4))
+            {
+                goto out;
+            }
+            scan_range(&fs, r, start, to);
+            done = to;
+        }
+        if(done < n && !targets_add(&keep, r->addr + done * 4, r->addr + n * 4))
+        {
+            goto out;
+        }
+    }
+    if(ptrs && !scan_ptrs(&fs, &in->img, &in->data))
+    {
+        goto out;
+    }
+    sc->words += fs.words;
+    sc->cands += fs.cands;
+    if(fs.fail)
+    {
+        goto out;
+    }
+    targets_sort(&keep);
+    qsort(fresh.ref, fresh.num, sizeof(*fresh.ref), refs_cmp);
+
+    // The old references are sorted, so the new ones just have to be merged in.
+    size_t j = 0;
+    for(size_t i = 0; i < hdr->num; ++i)
+    {
+        if(idx.kind[i] == Ref_Ptr || !targets_hit(&keep, idx.source[i]))
+        {
+            continue;
+        }
+        ref_t ref = { .target = idx.target[i], .source = idx.source[i], .kind = idx.kind[i] };
+        for(; j < fresh.num && refs_cmp(&fresh.ref[j], &ref) < 0; ++j)
+        {
+            if(!refs_add(sc->refs, fresh.ref[j].source, fresh.ref[j].target, fresh.ref[j].kind))
+            {
+                goto out;
+            }
+        }
+        if(!refs_add(sc->refs, ref.source, ref.target, ref.kind))
+        {
+            goto out;
+        }
+    }
+    for(; j < fresh.num; ++j)
+    {
+        if(!refs_add(sc->refs, fresh.ref[j].source, fresh.ref[j].target, fresh.ref[j].kind))
+        {
+            goto out;
+        }
+    }
+
+    ok = true;
+out:;
+    if(fresh.ref) free(fresh.ref);
+    if(keep.span) free(keep.span);
+    if(page) free(page);
+    index_close(&idx);
+    return ok;
+}
+
+// Everything a query runs against, set up once per file.
+typedef struct
+{
+    const input_t *in;
+    bool ptrs;              // Whether data pointers are wanted
+    const index_t *idx;     // Index to look targets up in instead of scanning, if any, opened once
+    const char *update;     // Index of an earlier build to take unchanged references from, if any
+    pool_t *pool;           // Threads to scan on with -j, made once, NULL to scan on this one
+} query_t;
+
+// Finds and prints all references to the targets of sc.
+static bool run_query(scan_t *sc, out_t *o, const query_t *q)
+{
+    if(q->idx)
+    {
+        if(!index_query(q->idx, sc, &q->in->code))
+        {
+            return false;
+        }
+    }
+    else if(q->update)
+    {
+        if(!index_update(q->update, sc, q->in, q->ptrs))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        if(q->pool)
+        {
+            if(!scan_parallel(sc, o, q->in, 1, false, q->ptrs, q->pool))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            const ranges_t *code = &q->in->code;
+            for(size_t i = 0; i < code->num; ++i)
+            {
+                const range_t *r = &code->r[i];
+                for(size_t from = 0, n = r->e - r->p; from < n; from += CHUNK_WORDS)
+                {
+                    scan_range(sc, r, from, n - from > CHUNK_WORDS ? from + CHUNK_WORDS : n);
+                    out_hits(o, sc->hits);
+                }
+            }
+            if(q->ptrs && !scan_ptrs(sc, &q->in->img, &q->in->data))
+            {
+                return false;
+            }
+        }
+    }
+    out_hits(o, sc->hits);
+    return !sc->fail;
+}
+
+static void out_error(out_t *o, const char *msg, const char *arg)
+{
+    if(o->fmt == Fmt_Json)
+    {
+        out_str(o, "{\"error\":\"");
+        out_jstr(o, msg);
+        out_jstr(o, arg);
+        out_str(o, "\"}\n");
+    }
+    else if(o->fmt == Fmt_Text)
+    {
+        out_str(o, "error: ");
+        out_str(o, msg);
+        out_str(o, arg);
+        out_str(o, "\n");
+    }
+    else
+    {
+        fprintf(stderr, "%s%s\n", msg, arg);
+    }
+}
+
+// Query server. Reads one query per line: targets as on the command line, plus optionally
+// kind=name[,name...] to only report those kinds. Each result is followed by a line with
+// just a ".", with JSON output by {"done":true}, or with binary output by a record of kind
+// 0xff. Returns at the end of input, or false if anything fails, including writing the output.
+static bool serve(targets_t *tg, scan_t *sc, out_t *o, const query_t *q, FILE *in)
+{
+    bool ok = false;
+    char *line = NULL;
+    size_t cap = 0;
+    while(getline(&line, &cap, in) != -1)
+    {
+        bool bad = false;
+        tg->num = 0;
+        o->kinds = 0;
+        char *save = NULL;
+        for(char *tok = strtok_r(line, " \t\r\n", &save); tok && !bad; tok = strtok_r(NULL, " \t\r\n", &save))
+        {
+            if(strncmp(tok, "kind=", 5) == 0)
+            {
+                char *ksave = NULL;
+                for(char *k = strtok_r(tok + 5, ",", &ksave); k && !bad; k = strtok_r(NULL, ",", &ksave))
+                {
+                    size_t i = 0;
+                    while(i < sizeof(ref_names) / sizeof(ref_names[0]) && strcmp(ref_names[i], k) != 0)
+                    {
+                        ++i;
+                    }
+                    if(i == sizeof(ref_names) / sizeof(ref_names[0]))
+                    {
+                        out_error(o, "Bad kind: ", k);
+                        bad = true;
+                    }
+                    else
+                    {
+                        o->kinds |= 1U << i;
+                    }
+                }
+                continue;
+            }
+            uint64_t lo, hi;
+            if(!parse_target(tok, &lo, &hi))
+            {
+                out_error(o, "Bad target: ", tok);
+                bad = true;
+            }
+            else if(!targets_add(tg, lo, hi))
+            {
+                goto out;
+            }
+        }
+        targets_sort(tg);
+        if(!bad && tg->num != 0 && !run_query(sc, o, q))
+        {
+            goto out;
+        }
+        if(o->fmt == Fmt_Bin)
+        {
+            hit_t end = { .kind = 0xff };
+            out_mem(o, &end, sizeof(end));
+        }
+        else
+        {
+            out_str(o, o->fmt == Fmt_Json ? "{\"done\":true}\n" : ".\n");
+        }
+        out_flush(o);
+        if(o->fail)
+        {
+            goto out;
+        }
+    }
+    ok = true;
+out:;
+    if(line) free(line);
+    return ok;
+}
+
+static volatile sig_atomic_t serve_stop;
+
+static void serve_signal(int sig)
+{
+    (void)sig;
+    serve_stop = 1;
+}
+
+// Serves one client after another on a Unix socket, until SIGINT or SIGTERM, or something fails.
+// Others wait in the listen backlog until the current one disconnects.
+static bool serve_socket(const char *path, targets_t *tg, scan_t *sc, out_t *o, const query_t *q)
+{
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof(sa.sun_path))
+    {
+        fprintf(stderr, "Socket path too long.\n");
+        return false;
+    }
+    strcpy(sa.sun_path, path);
+    // Clean up after a previous run, but never remove anything else.
+    struct stat s;
+    if(lstat(path, &s) == 0 && S_ISSOCK(s.st_mode))
+    {
+        unlink(path);
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock == -1)
+    {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        return false;
+    }
+    if(bind(sock, (struct sockaddr*)&sa, sizeof(sa)) != 0 || listen(sock, 16) != 0)
+    {
+        fprintf(stderr, "bind(%s): %s\n", path, strerror(errno));
+        close(sock);
+        return false;
+    }
+    // Without SA_RESTART, so that accept() returns to check for it.
+    struct sigaction sa_stop = { .sa_handler = serve_signal };
+    sigaction(SIGINT, &sa_stop, NULL);
+    sigaction(SIGTERM, &sa_stop, NULL);
+    bool ok = false;
+    while(!serve_stop)
+    {
+        int c = accept(sock, NULL, NULL);
+        if(c == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+            goto out;
+        }
+        FILE *in = fdopen(c, "r");
+        if(!in)
+        {
+            fprintf(stderr, "fdopen: %s\n", strerror(errno));
+            close(c);
+            goto out;
+        }
+        o->fd = c;
+        o->len = 0;
+        o->fail = false;
+        if(o->fmt == Fmt_Bin)
+        {
+            hit_hdr_t hh = { .magic = HIT_MAGIC, .version = HIT_VERSION, .size = sizeof(hit_t) };
+            out_mem(o, &hh, sizeof(hh));
+        }
+        bool served = serve(tg, sc, o, q, in);
+        fclose(in);
+        if(!served && !o->fail)
+        {
+            goto out;
+        }
+    }
+    ok = true;
+    unlink(path);
+out:;
+    close(sock);
+    return ok;
+}
+
+// --stats: what was scanned and found, and where the time went.
+typedef struct
+{
+    char name[17];
+    uint64_t bytes;
+} seg_stat_t;
+
+typedef struct
+{
+    uint64_t words;     // Instructions decoded
+    uint64_t cands;     // Of those, the ones the prefilter passed on
+    uint64_t hits[Ref_Ptr + 1];
+    seg_stat_t *seg;    // Bytes of code by segment name
+    size_t nseg;
+    size_t capseg;
+    uint64_t load;      // Wall clock nanoseconds spent mapping and parsing the input,
+    uint64_t scan;      // scanning it, including printing hits as they're found,
+    uint64_t finish;    // and writing what's left, e.g. an index
+    uint64_t print;     // Of the scan, the main thread's time printing hits. With -j, scanning goes on meanwhile.
+    uint64_t cpu;       // CPU time of all threads together while scanning
+    uint64_t faults_load; // Page faults that had to wait for I/O while loading,
+    uint64_t faults_scan; // and while scanning
+} stats_t;
+
+// Wall clock and CPU time so far, and page faults that had to read from disk.
+typedef struct
+{
+    uint64_t wall;
+    uint64_t cpu;
+    uint64_t faults;
+} usage_t;
+
+static usage_t usage_now(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (usage_t)
+    {
+        .wall   = now_ns(),
+        .cpu    = (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000 + (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000,
+        .faults = ru.ru_majflt,
+    };
+}
+
+static bool stats_code(stats_t *st, const ranges_t *code)
+{
+    for(size_t i = 0; i < code->num; ++i)
+    {
+        char name[17] = { 0 };
+        strncpy(name, code->r[i].seg, sizeof(name) - 1);
+        size_t j = 0;
+        while(j < st->nseg && strcmp(st->seg[j].name, name) != 0)
+        {
+            ++j;
+        }
+        if(j == st->nseg)
+        {
+            if(!grow(&st->seg, &st->capseg, st->nseg, sizeof(*st->seg)))
+            {
+                return false;
+            }
+            st->seg[st->nseg] = (seg_stat_t){ .bytes = 0 };
+            memcpy(st->seg[st->nseg++].name, name, sizeof(name));
+        }
+        st->seg[j].bytes += (uint64_t)(code->r[i].e - code->r[i].p) * 4;
+    }
+    return true;
+}
+
+// Goes to stderr, so as not to get mixed up with the hits.
+static void stats_print(const stats_t *st, bool json)
+{
+    // Bytes per nanosecond are GB/s.
+    double gbps = st->scan ? (double)st->words * 4 / st->scan : 0;
+    if(json)
+    {
+        fprintf(stderr, "{\"words\":%llu,\"candidates\":%llu,\"hits\":{", (unsigned long long)st->words, (unsigned long long)st->cands);
+        for(size_t i = 0; i <= Ref_Ptr; ++i)
+        {
+            fprintf(stderr, "%s\"%s\":%llu", i ? "," : "", ref_names[i], (unsigned long long)st->hits[i]);
+        }
+        fprintf(stderr, "},\"segments\":[");
+        for(size_t i = 0; i < st->nseg; ++i)
+        {
+            fprintf(stderr, "%s{\"name\":\"", i ? "," : "");
+            for(const char *c = st->seg[i].name; *c; ++c)
+            {
+                if(*c == '"' || *c == '\\' || (uint8_t)*c < 0x20 || (uint8_t)*c >= 0x7f)
+                {
+                    fprintf(stderr, "\\u%04x", (uint8_t)*c);
+                }
+                else
+                {
+                    fputc(*c, stderr);
+                }
+            }
+            fprintf(stderr, "\",\"bytes\":%llu}", (unsigned long long)st->seg[i].bytes);
+        }
+        fprintf(stderr, "],\"time\":{\"load\":%.6f,\"scan\":%.6f,\"finish\":%.6f,\"print\":%.6f,\"cpu\":%.6f},\"page_ins\":{\"load\":%llu,\"scan\":%llu},\"gbps\":%.3f}\n",
+                st->load / 1e9, st->scan / 1e9, st->finish / 1e9, st->print / 1e9, st->cpu / 1e9, (unsigned long long)st->faults_load, (unsigned long long)st->faults_scan, gbps);
+    }
+    else
+    {
+        fprintf(stderr, "Decoded %llu words, %llu of them past the prefilter.\n", (unsigned long long)st->words, (unsigned long long)st->cands);
+        fprintf(stderr, "Hits:");
+        for(size_t i = 0; i <= Ref_Ptr; ++i)
+        {
+            fprintf(stderr, "%s %s %llu", i ? "," : "", ref_names[i], (unsigned long long)st->hits[i]);
+        }
+        fprintf(stderr, "\n");
+        for(size_t i = 0; i < st->nseg; ++i)
+        {
+            fprintf(stderr, "Segment %s: %llu bytes of code\n", st->seg[i].name, (unsigned long long)st->seg[i].bytes);
+        }
+        fprintf(stderr, "Load %.3fs, scan %.3fs, finish %.3fs, %.2f GB/s\n", st->load / 1e9, st->scan / 1e9, st->finish / 1e9, gbps);
+        fprintf(stderr, "Scan CPU time %.3fs over all threads, printing hits %.3fs on the main thread\n", st->cpu / 1e9, st->print / 1e9);
+        fprintf(stderr, "Page-ins %llu while loading, %llu while scanning\n", (unsigned long long)st->faults_load, (unsigned long long)st->faults_scan);
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    int retval = -1;
+    int fd = -1;
+    targets_t tg = { 0 };
+    refs_t refs = { 0 };
+    input_t in = { 0 };
+    input_t *ins = NULL;
+    size_t nins = 0;
+    paths_t paths = { 0 };
+    strs_t str = { 0 };
+    hits_t hits = { 0 };
+    out_t o = { .tg = &tg, .fmt = Fmt_Text, .fd = STDOUT_FILENO };
+    index_t idx = { .fd = -1, .mem = MAP_FAILED };
+    stats_t st = { 0 };
+    pool_t pool = { 0 };
+    bool pooled = false,  // pool has to be stopped
+         all = false,
+         ptrs = false,
+         server = false,
+         stats = false;
+    size_t jobs = 1;
+    const char *idx_out   = NULL,
+               *idx_in    = NULL,
+               *idx_up    = NULL,
+               *graph_out = NULL,
+               *sock      = NULL;
+    const char **names = NULL,
+               **needles = NULL;
+    size_t nnames = 0,
+           capnames = 0,
+           nneedles = 0,
+           capneedles = 0;
+    int aoff = 1;
+    for(; aoff < argc; ++aoff)
+    {
+        if(argv[aoff][0] != '-' || argv[aoff][1] == '\0')
+        {
+            break;
+        }
+        if(strcmp(argv[aoff], "-f") == 0 && aoff + 1 < argc)
+        {
+            if(!targets_read(&tg, argv[++aoff]))
+            {
+                goto out;
+            }
+        }
+        else if(strcmp(argv[aoff], "-j") == 0 && aoff + 1 < argc)
+        {
+            const char *num = argv[++aoff];
+            char *end = NULL;
+            unsigned long long n = strtoull(num, &end, 10);
+            if(num[0] == '\0' || end[0] != '\0')
+            {
+                fprintf(stderr, "Bad number of jobs: %s\n", num);
+                goto out;
+            }
+            if(n == 0)
+            {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                n = cpus > 0 ? cpus : 1;
+            }
+            jobs = n;
+        }
+        else if(strcmp(argv[aoff], "-o") == 0 && aoff + 1 < argc)
+        {
+            const char *fmt = argv[++aoff];
+            if(strcmp(fmt, "text") == 0)
+            {
+                o.fmt = Fmt_Text;
+            }
+            else if(strcmp(fmt, "json") == 0)
+            {
+                o.fmt = Fmt_Json;
+            }
+            else if(strcmp(fmt, "bin") == 0)
+            {
+                o.fmt = Fmt_Bin;
+            }
+            else
+            {
+                fprintf(stderr, "Bad output format: %s\n", fmt);
+                goto out;
+            }
+        }
+        else if(strcmp(argv[aoff], "--stats") == 0)
+        {
+            stats = true;
+        }
+        else if(strcmp(argv[aoff], "--serve") == 0)
+        {
+            server = true;
+        }
+        else if(strcmp(argv[aoff], "--socket") == 0 && aoff + 1 < argc)
+        {
+            server = true;
+            sock = argv[++aoff];
+        }
+        else if(strcmp(argv[aoff], "-a") == 0)
+        {
+            all = true;
+        }
+        else if(strcmp(argv[aoff], "-d") == 0)
+        {
+            ptrs = true;
+        }
+        else if(strcmp(argv[aoff], "-i") == 0 && aoff + 1 < argc)
+        {
+            idx_in = argv[++aoff];
+        }
+        else if(strcmp(argv[aoff], "-I") == 0 && aoff + 1 < argc)
+        {
+            idx_out = argv[++aoff];
+        }
+        else if(strcmp(argv[aoff], "-u") == 0 && aoff + 1 < argc)
+        {
+            idx_up = argv[++aoff];
+        }
+        else if(strcmp(argv[aoff], "-k") == 0 && aoff + 1 < argc)
+        {
+            if(!grow(&names, &capnames, nnames, sizeof(*names)))
+            {
+                goto out;
+            }
+            names[nnames++] = argv[++aoff];
+        }
+        else if(strcmp(argv[aoff], "-s") == 0 && aoff + 1 < argc)
+        {
+            if(argv[aoff + 1][0] == '\0')
+            {
+                fprintf(stderr, "Can't search for an empty string.\n");
+                goto out;
+            }
+            if(!grow(&needles, &capneedles, nneedles, sizeof(*needles)))
+            {
+                goto out;
+            }
+            needles[nneedles++] = argv[++aoff];
+        }
+        else if(strcmp(argv[aoff], "-g") == 0 && aoff + 1 < argc)
+        {
+            graph_out = argv[++aoff];
+        }
+        else
+        {
+            fprintf(stderr, "Bad option: %s\n", argv[aoff]);
+            goto out;
+        }
+    }
+    bool collect = idx_out || graph_out;
+    if(argc - aoff < 1 || (collect || server ? argc - aoff != 1 || tg.num != 0 || nneedles != 0 || (collect && (idx_in || server)) : idx_up || (argc - aoff < 2 && tg.num == 0 && nneedles == 0)))
+    {
+        fprintf(stderr, "Usage: %s [-ad] [-j jobs] [-o fmt] [-k entry] [-f list] [-s string] [-i index] [--stats] file [file...] [--] [target...]\n"
+                        "       %s [-ad] [-j jobs] [-I index] [-g graph] [-u old] [--stats] file\n"
+                        "       %s [-ad] [-j jobs] [-o fmt] [-k entry] [-i index] --serve|--socket path file\n"
+                        "    -a        Decode all segments, not just sections containing instructions\n"
+                        "    -d        Also find pointers in data sections, including chained fixups\n"
+                        "    -j jobs   Scan on this many threads, 0 for one per CPU (default 1)\n"
+                        "    -o fmt    Output format: text (default), json (one object per line) or bin\n"
+                        "    -k entry  Only scan this fileset entry or shared cache image, e.g. com.apple.kernel (repeatable),\n"
+                        "              not with -I or -g\n"
+                        "    -f list   Read targets from file, one per line (\"-\" for stdin)\n"
+                        "    -s string Find the strings containing this in __cstring and __const sections, and take them as targets (repeatable)\n"
+                        "    -i index  Look up targets in a prebuilt index instead of scanning\n"
+                        "    -I index  Decode all references once and write them to an index\n"
+                        "    -g graph  Decode all references once and write them as a graph, grouped by source\n"
+                        "    -u old    With -I or -g, take references over from the index of an earlier build,\n"
+                        "              and only decode the pages of code that changed since\n"
+                        "    --serve   Map the file once, then answer queries from stdin, one per line:\n"
+                        "              targets, optionally with kind=name[,name...]. Each result ends with a \".\" line,\n"
+                        "              or {\"done\":true} with -o json\n"
+                        "    --socket path  Same, but on a Unix socket, for one client at a time, until SIGINT or SIGTERM\n"
+                        "    --stats   Report how much was decoded and found, and where the time went, on stderr (as JSON with -o json)\n"
+                        "Targets are hex addresses, or ranges lo-hi (hi exclusive) or lo+len. Hits are listed once for each of them they fall into.\n"
+                        "File can be \"-\" for stdin. Pipes are read in one pass without keeping the input, but without -d, -i, -k or filesets.\n"
+                        "Several files or directories (searched recursively) can be scanned at once, with hits grouped by file.\n"
+                        "Files and targets are told apart by a -- between them. Without one, arguments after the first that parse\n"
+                        "as targets are taken as such, and refused if there's also a file by that name (e.g. cafe, use ./cafe).\n"
+                        , argv[0], argv[0], argv[0]);
+        goto out;
+    }
+    if(idx_out && nnames)
+    {
+        fprintf(stderr, "An index has to cover the whole file, -k can't be used with -I.\n");
+        goto out;
+    }
+    if(graph_out && nnames)
+    {
+        fprintf(stderr, "A graph has to cover the whole file, -k can't be used with -g.\n");
+        goto out;
+    }
+    o.only_own = nnames != 0;
+    // Past the first file come more files or directories, then targets, with "--" in between.
+    // Without it, whatever parses as a target is one, as long as it isn't a file too.
+    const char *path = argv[aoff++];
+    struct stat s;
+    bool corpus = strcmp(path, "-") != 0 && stat(path, &s) == 0 && S_ISDIR(s.st_mode);
+    int sep = 0;
+    for(int i = aoff; i < argc && !sep; ++i)
+    {
+        if(strcmp(argv[i], "--") == 0)
+        {
+            sep = i;
+        }
+    }
+    for(int i = aoff; i < argc; ++i)
+    {
+        if(i == sep)
+        {
+            continue;
+        }
+        uint64_t lo, hi;
+        bool is_target = (!sep || i > sep) && parse_target(argv[i], &lo, &hi),
+             is_file   = (!sep || i < sep) && stat(argv[i], &s) == 0;
+        if(is_target && is_file)
+        {
+            fprintf(stderr, "%s is both a target and a file, put -- before targets or write e.g. ./%s for the file.\n", argv[i], argv[i]);
+            goto out;
+        }
+        if(is_target)
+        {
+            if(!targets_add(&tg, lo, hi))
+            {
+                goto out;
+            }
+        }
+        else if(is_file)
+        {
+            corpus = true;
+        }
+        else if(sep && i < sep)
+        {
+            fprintf(stderr, "stat(%s): %s\n", argv[i], strerror(errno));
+            goto out;
+        }
+        else
+        {
+            fprintf(stderr, "Bad target: %s\n", argv[i]);
+            goto out;
+        }
+    }
+    targets_sort(&tg);
+    if(corpus)
+    {
+        if(collect || server || idx_in || nnames || nneedles || o.fmt == Fmt_Bin || strcmp(path, "-") == 0)
+        {
+            fprintf(stderr, "Several files can't be scanned with -i, -I, -g, -k, -s, -o bin, serving or stdin.\n");
+            goto out;
+        }
+        if(!paths_walk(&paths, path, false))
+        {
+            goto out;
+        }
+        for(int i = aoff; i < argc; ++i)
+        {
+            uint64_t lo, hi;
+            if((sep ? i < sep : !parse_target(argv[i], &lo, &hi)) && !paths_walk(&paths, argv[i], false))
+            {
+                goto out;
+            }
+        }
+    }
+
+    o.buf = malloc(OUT_SIZE);
+    if(!o.buf)
+    {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        goto out;
+    }
+    if(o.fmt == Fmt_Bin && !collect)
+    {
+        hit_hdr_t hh = { .magic = HIT_MAGIC, .version = HIT_VERSION, .size = sizeof(hit_t) };
+        out_mem(&o, &hh, sizeof(hh));
+    }
+
+    prefilter_init();
+    mem_init();
+    scan_t sc = { .tg = &tg, .refs = collect ? &refs : NULL, .hits = &hits };
+    // Only needed to print hits
+    bool want_fn = !collect && o.fmt != Fmt_Bin;
+    // Files that couldn't be loaded don't stop a corpus scan, but still make it fail.
+    bool loaded = true;
+    uint64_t insize = 0;
+    usage_t u_load = usage_now(),
+            u_scan = u_load;
+
+    if(corpus)
+    {
+        ins = calloc(paths.num ? paths.num : 1, sizeof(*ins));
+        if(!ins)
+        {
+            fprintf(stderr, "malloc: %s\n", strerror(errno));
+            goto out;
+        }
+        loaded = inputs_load(ins, &nins, &paths, all, ptrs, want_fn);
+        for(size_t i = 0; i < nins; ++i)
+        {
+            if(stats && !stats_code(&st, &ins[i].code))
+            {
+                goto out;
+            }
+        }
+        pooled = true;
+        if(!pool_start(&pool, jobs))
+        {
+            goto out;
+        }
+        u_scan = usage_now();
+        if(!scan_parallel(&sc, &o, ins, nins, true, ptrs, &pool))
+        {
+            goto out;
+        }
+    }
+    else
+    {
+        fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+        if(fd == -1)
+        {
+            fprintf(stderr, "open: %s\n", strerror(errno));
+            goto out;
+        }
+
+        if(fstat(fd, &s) != 0)
+        {
+            fprintf(stderr, "fstat: %s\n", strerror(errno));
+            goto out;
+        }
+
+        // Pipes and the like can't be mapped, so they're read front to back instead.
+        insize = s.st_size;
+        in.path = path;
+        if(!S_ISREG(s.st_mode))
+        {
+            if(ptrs || idx_in || idx_up || nnames || nneedles || server)
+            {
+                fprintf(stderr, "Input isn't a regular file, but -d, -i, -k, -s, -u and serving need one.\n");
+                goto out;
+            }
+            u_scan = usage_now();
+            if(!scan_stream(&sc, &o, fd, all, in.img.uuid, &insize))
+            {
+                goto out;
+            }
+        }
+        else
+        {
+            if(!input_load(&in, fd, s.st_size, all, ptrs, nneedles != 0, want_fn, names, nnames))
+            {
+                goto out;
+            }
+            out_input(&o, &in, false);
+            if(nneedles)
+            {
+                for(size_t i = 0; i < nneedles; ++i)
+                {
+                    if(!strs_search(&str, &in.strs, needles[i]))
+                    {
+                        goto out;
+                    }
+                }
+                if(!strs_targets(&str, &tg))
+                {
+                    goto out;
+                }
+                o.str = &str;
+            }
+
+            if(stats && !stats_code(&st, &in.code))
+            {
+                goto out;
+            }
+
+            if(idx_in && (!index_open(idx_in, &idx) || !index_current(&idx, in.img.uuid, in.size)))
+            {
+                goto out;
+            }
+            if(server)
+            {
+                // Clients going away are handled by write errors.
+                signal(SIGPIPE, SIG_IGN);
+            }
+
+            // Started once, a server reuses the threads for every query.
+            if(jobs > 1 && !idx_in && !idx_up)
+            {
+                pooled = true;
+                if(!pool_start(&pool, jobs))
+                {
+                    goto out;
+                }
+            }
+            u_scan = usage_now();
+            query_t q = { .in = &in, .ptrs = ptrs, .idx = idx_in ? &idx : NULL, .update = idx_up, .pool = pooled ? &pool : NULL };
+            if(sock ? !serve_socket(sock, &tg, &sc, &o, &q) : server ? !serve(&tg, &sc, &o, &q, stdin) : !run_query(&sc, &o, &q))
+            {
+                goto out;
+            }
+        }
+    }
+    usage_t u_out = usage_now();
+    if(sc.fail)
+    {
+        goto out;
+    }
+    // With -I and -g, everything found counts.
+    for(size_t i = 0; stats && i < refs.num; ++i)
+    {
+        ++st.hits[refs.ref[i].kind];
+    }
+    if(idx_out && !index_write(idx_out, &refs, &in.code, in.img.uuid, insize))
+    {
+        goto out;
+    }
+    if(graph_out && !graph_write(graph_out, &refs, in.img.uuid, insize))
+    {
+        goto out;
+    }
+    out_flush(&o);
+    if(stats)
+    {
+        st.words = sc.words;
+        st.cands = sc.cands;
+        for(size_t i = 0; i <= Ref_Ptr; ++i)
+        {
+            st.hits[i] += o.count[i];
+        }
+        st.load   = u_scan.wall - u_load.wall;
+        st.scan   = u_out.wall - u_scan.wall;
+        st.finish = now_ns() - u_out.wall;
+        st.print  = o.time;
+        st.cpu    = u_out.cpu - u_scan.cpu;
+        st.faults_load = u_scan.faults - u_load.faults;
+        st.faults_scan = u_out.faults - u_scan.faults;
+        stats_print(&st, o.fmt == Fmt_Json);
+    }
+    if(o.fail || !loaded)
+    {
+        goto out;
+    }
+
+    retval = 0;
+out:;
+    if(pooled) pool_stop(&pool);
+    if(fd != -1) close(fd);
+    index_close(&idx);
+    input_free(&in);
+    for(size_t i = 0; i < nins; ++i)
+    {
+        input_free(&ins[i]);
+    }
+    if(ins) free(ins);
+    for(size_t i = 0; i < paths.num; ++i)
+    {
+        free(paths.path[i]);
+    }
+    if(paths.path) free(paths.path);
+    if(paths.found) free(paths.found);
+    if(names) free(names);
+    if(needles) free(needles);
+    if(str.s) free(str.s);
+    if(st.seg) free(st.seg);
+    if(refs.ref) free(refs.ref);
+    if(tg.span) free(tg.span);
+    if(hits.hit) free(hits.hit);
+    if(o.buf) free(o.buf);
     return retval;
 }